@@ -1,12 +1,20 @@
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "app.h"
+#include "coresweep.h"
 #include "cpudetect.h"
+#include "envdetect.h"
 #include "instbench.h"
+#include "perfcounter.h"
 #include "schedutils.h"
 
 namespace cult {
 
+// Interrupts are sampled for this long to select the least interrupted CPU.
+static constexpr uint32_t kInterruptWindowMs = 100;
+
 App::App(int argc, char* argv[])
   : _cmd(argc, argv),
     _json(&_output) {}
@@ -20,6 +28,26 @@ void App::parseArguments() {
   if (_cmd.hasKey("--quiet")) _verbose = false;
   if (_cmd.hasKey("--estimate")) _estimate = true;
   if (_cmd.hasKey("--no-rounding")) _round = false;
+  if (_cmd.hasKey("--pipeline")) _pipeline = true;
+  if (_cmd.hasKey("--resume")) _resume = true;
+  if (_cmd.hasKey("--stream")) _stream = true;
+  if (_cmd.hasKey("--ndjson")) _ndjson = _stream = true;
+  if (_cmd.hasKey("--no-calibration")) _calibrate = false;
+  if (_cmd.hasKey("--stats")) _stats = true;
+  if (_cmd.hasKey("--snap")) _snap = true;
+  if (_cmd.hasKey("--detect-noise")) _detectNoise = true;
+  if (_cmd.hasKey("--isolate")) _isolate = true;
+  if (_cmd.hasKey("--all-cores")) _allCores = true;
+
+  // A stream written to stdout would be interleaved with the verbose output and
+  // the dumped code, so streaming to stdout implies --quiet.
+  if (_stream && !_cmd.valueOf("--output")) {
+    _verbose = false;
+    if (_dump) {
+      printf("--dump can't be combined with --stream or --ndjson without --output\n");
+      exit(1);
+    }
+  }
 
   if (help() || verbose()) {
     printf("CULT v%u.%u.%u [Using AsmJit v%u.%u.%u]\n",
@@ -39,8 +67,44 @@ void App::parseArguments() {
     printf("  --quiet            - Quiet mode, no output except final JSON\n");
     printf("  --estimate         - Estimate only (faster, but less precise)\n");
     printf("  --no-rounding      - Don't round cycles and latencies\n");
+    printf("  --snap             - Snap results to fractions and report residuals\n");
+    printf("  --stats            - Output distribution of samples of each result\n");
     printf("  --instruction=name - Only benchmark a particular instruction\n");
+    printf("  --match=glob       - Only benchmark specs matching a glob pattern\n");
+    printf("  --regex=re         - Only benchmark specs matching a regular expression\n");
+    printf("  --isa=A,B          - Only benchmark specs requiring any of CPU features\n");
+    printf("  --width=xmm,ymm    - Only benchmark specs having any of register kinds\n");
+    printf("  --operand=mem      - Only benchmark specs having any of operand kinds\n");
+    printf("                       (filters can be negated by '!', like --operand=!mem)\n");
+    printf("                       (repeated filters must all match)\n");
+    printf("  --from-listing=f   - Only benchmark forms used by an objdump listing\n");
     printf("  --output=file      - Output to file instead of stdout\n");
+    printf("  --csv=file         - Also write results as CSV\n");
+    printf("  --bin=file         - Also write results in a columnar binary format\n");
+    printf("  --xml=file         - Also write results as uops.info-like XML\n");
+    printf("  --stream           - Write each result to the output once measured (implies --quiet without --output)\n");
+    printf("  --ndjson           - Stream newline delimited JSON (implies --stream)\n");
+    printf("  --checkpoint=file  - Persist each result to a checkpoint file\n");
+    printf("  --resume           - Skip results already stored in the checkpoint\n");
+    printf("  --plan-cache=file  - Cache classified specs in a binary file\n");
+    printf("  --verify-against=f - Quickly verify results against a baseline JSON\n");
+    printf("  --threshold=X      - Deviation tolerated by --verify-against [0.1]\n");
+    printf("  --time-budget=T    - Finish within T seconds (or Tm, Th)\n");
+    printf("  --repeat=N         - Measure N times in shuffled order and score variance\n");
+    printf("  --max-cv=X         - Variation between passes considered unstable [0.05]\n");
+    printf("  --weights=file     - Measure specs having a higher weight first\n");
+    printf("  --profile-self[=f] - Profile cult itself [cult-profile.json]\n");
+    printf("  --cpu=N            - Measure on CPU N [first allowed CPU]\n");
+    printf("  --isolate          - Real-time priority, locked memory and a quiet CPU\n");
+    printf("  --all-cores        - Only measure canary specs on every CPU and compare\n");
+    printf("  --jobs=N           - Benchmark on N physical cores in parallel\n");
+    printf("  --pipeline         - Compile on a helper core while measuring\n");
+    printf("  --batch=N          - Number of samples taken by a single call [16]\n");
+    printf("  --clock=X          - Cycle counter to use (auto, tsc, pmc) [auto]\n");
+    printf("  --detect-noise     - Take batches disturbed by interrupts again\n");
+    printf("  --no-calibration   - Report TSC ticks instead of calibrated core cycles\n");
+    printf("  --tolerance=X      - Relative tolerance of the minimum [0.005]\n");
+    printf("  --confidence=X     - Confidence that the minimum converged [0.999]\n");
     printf("\n");
     exit(0);
   }
@@ -53,35 +117,341 @@ void App::parseArguments() {
       exit(1);
     }
   }
+
+  static const struct {
+    const char* key;
+    InstFilter::Kind kind;
+  } filterOptions[] = {
+    { "--match"  , InstFilter::kKindMatch   },
+    { "--regex"  , InstFilter::kKindRegex   },
+    { "--isa"    , InstFilter::kKindIsa     },
+    { "--width"  , InstFilter::kKindWidth   },
+    { "--operand", InstFilter::kKindOperand }
+  };
+
+  // Each occurrence of a filter option is a separate term, so repeated options
+  // must all match (like `--operand=mem --operand=!imm`).
+  for (const auto& option : filterOptions) {
+    std::vector<const char*> values;
+    _cmd.valuesOf(option.key, values);
+
+    for (const char* value : values) {
+      std::string error;
+      if (!_filter.addTerm(option.kind, value, error)) {
+        printf("Invalid filter %s: %s\n", option.key, error.c_str());
+        exit(1);
+      }
+    }
+  }
+
+  // Precision of measurements, `--estimate` only changes the defaults.
+  _precision = Convergence::defaultParams(_estimate);
+
+  const char* tolerance = _cmd.valueOf("--tolerance");
+  if (tolerance) {
+    _precision.tolerance = strtod(tolerance, nullptr);
+    if (!(_precision.tolerance > 0.0 && _precision.tolerance < 1.0)) {
+      printf("Invalid tolerance '%s', must be within (0, 1)\n", tolerance);
+      exit(1);
+    }
+  }
+
+  const char* confidence = _cmd.valueOf("--confidence");
+  if (confidence) {
+    _precision.confidence = strtod(confidence, nullptr);
+    if (!(_precision.confidence > 0.0 && _precision.confidence < 1.0)) {
+      printf("Invalid confidence '%s', must be within (0, 1)\n", confidence);
+      exit(1);
+    }
+  }
+
+  _checkpointFile = _cmd.valueOf("--checkpoint");
+  if (_resume && !_checkpointFile) {
+    printf("--resume requires --checkpoint=file\n");
+    exit(1);
+  }
+
+  _planFile = _cmd.valueOf("--plan-cache");
+
+  _verifyFile = _cmd.valueOf("--verify-against");
+  if (_verifyFile && _checkpointFile) {
+    printf("--verify-against can't be combined with --checkpoint\n");
+    exit(1);
+  }
+
+  const char* repeat = _cmd.valueOf("--repeat");
+  if (repeat) {
+    _repeat = uint32_t(strtoul(repeat, nullptr, 10));
+    if (_repeat < 2 || _repeat > 1000) {
+      printf("Invalid number of passes '%s', must be within [2, 1000]\n", repeat);
+      exit(1);
+    }
+
+    if (_checkpointFile || _verifyFile) {
+      printf("--repeat can't be combined with --checkpoint or --verify-against\n");
+      exit(1);
+    }
+  }
+
+  const char* maxCv = _cmd.valueOf("--max-cv");
+  if (maxCv) {
+    _maxCv = strtod(maxCv, nullptr);
+    if (!(_maxCv > 0.0)) {
+      printf("Invalid coefficient of variation '%s', must be greater than 0\n", maxCv);
+      exit(1);
+    }
+  }
+
+  const char* threshold = _cmd.valueOf("--threshold");
+  if (threshold) {
+    _verifyThreshold = strtod(threshold, nullptr);
+    if (!(_verifyThreshold > 0.0)) {
+      printf("Invalid threshold '%s', must be greater than 0\n", threshold);
+      exit(1);
+    }
+  }
+
+  const char* timeBudget = _cmd.valueOf("--time-budget");
+  if (timeBudget) {
+    char* end = nullptr;
+    _timeBudget = strtod(timeBudget, &end);
+
+    if (*end == 'm')
+      _timeBudget *= 60.0;
+    else if (*end == 'h')
+      _timeBudget *= 3600.0;
+    else if (*end != 's' && *end != '\0')
+      _timeBudget = 0.0;
+
+    if (!(_timeBudget > 0.0)) {
+      printf("Invalid time budget '%s', use seconds like 90 or 90s, or 5m, 1h\n", timeBudget);
+      exit(1);
+    }
+  }
+
+  _weightsFile = _cmd.valueOf("--weights");
+  _listingFile = _cmd.valueOf("--from-listing");
+
+  const char* profileFile = _cmd.valueOf("--profile-self");
+  if (profileFile) {
+    _profileFile = profileFile[0] ? profileFile : "cult-profile.json";
+    _profiler.enable();
+  }
+
+  const char* batch = _cmd.valueOf("--batch");
+  if (batch) {
+    _batchSize = uint32_t(strtoul(batch, nullptr, 10));
+    if (_batchSize == 0 || _batchSize > 65536) {
+      printf("Invalid batch size '%s', must be within [1, 65536]\n", batch);
+      exit(1);
+    }
+  }
+
+  const char* clock = _cmd.valueOf("--clock");
+  if (clock) {
+    if (strcmp(clock, "auto") == 0)
+      _clock = kClockAuto;
+    else if (strcmp(clock, "tsc") == 0)
+      _clock = kClockTSC;
+    else if (strcmp(clock, "pmc") == 0)
+      _clock = kClockPMC;
+    else {
+      printf("Invalid clock '%s', use auto, tsc or pmc\n", clock);
+      exit(1);
+    }
+  }
+
+  const char* cpu = _cmd.valueOf("--cpu");
+  if (cpu) {
+    char* end = nullptr;
+    _cpu = uint32_t(strtoul(cpu, &end, 10));
+    if (end == cpu || *end != '\0') {
+      printf("Invalid CPU '%s'\n", cpu);
+      exit(1);
+    }
+    _cpuOption = cpu;
+  }
+
+  const char* jobs = _cmd.valueOf("--jobs");
+  if (jobs) {
+    _jobs = uint32_t(strtoul(jobs, nullptr, 10));
+    if (_jobs == 0) {
+      printf("Invalid number of jobs '%s'\n", jobs);
+      exit(1);
+    }
+  }
+
+  if (_allCores && (_checkpointFile || _verifyFile || _repeat || _jobs > 1 || _pipeline)) {
+    printf("--all-cores can't be combined with --checkpoint, --verify-against, --repeat, --jobs or --pipeline\n");
+    exit(1);
+  }
+}
+
+// Selects the CPU to measure on, which must be one the process is allowed to run
+// on. Without `--cpu` it's the first allowed CPU, or the CPU that handled the
+// least interrupts when isolating.
+bool App::selectCpu() {
+  SchedUtils::allowedCpus(_allowedCpus);
+
+  if (_cpuOption) {
+    if (std::find(_allowedCpus.begin(), _allowedCpus.end(), _cpu) == _allowedCpus.end()) {
+      printf("CPU %u is not available to the process\n", _cpu);
+      return false;
+    }
+
+    _measureCpus = _allowedCpus;
+    _cpuSource = "option";
+    return true;
+  }
+
+  _measureCpus = _allowedCpus;
+  _cpu = _allowedCpus[0];
+
+  if (_isolate) {
+    uint32_t cpu;
+    if (SchedUtils::leastInterruptedCpu(_allowedCpus, kInterruptWindowMs, &cpu)) {
+      _cpu = cpu;
+      _cpuSource = "least-interrupted";
+    }
+    else if (verbose()) {
+      printf("Isolate: couldn't read interrupts of CPUs, using CPU %u\n", _cpu);
+    }
+  }
+
+  return true;
+}
+
+// Isolates the measuring thread as much as possible without root. Each step can
+// fail independently, which is reported and the benchmark continues without it.
+// Worker threads inherit the scheduling policy and prefault their own stacks.
+void App::isolate() {
+  std::string error;
+
+  _realtime = SchedUtils::setRealtime(error);
+  if (!_realtime && verbose())
+    printf("Isolate: couldn't switch to SCHED_FIFO: %s\n", error.c_str());
+
+  _memoryLocked = SchedUtils::lockMemory(error);
+  if (!_memoryLocked && verbose())
+    printf("Isolate: couldn't lock memory: %s\n", error.c_str());
+
+  SchedUtils::prefaultStack(SchedUtils::kPrefaultStackSize);
+
+  if (verbose())
+    printf("Isolate: measuring on CPU %u (%s)\n", _cpu, _cpuSource);
 }
 
 int App::run() {
-  SchedUtils::setAffinity(0);
+  if (!selectCpu())
+    return 1;
+
+  SchedUtils::setAffinity(_cpu);
+
+  if (_isolate)
+    isolate();
+
+  // Core cycles are preferred to TSC (reference cycles) if the PMU is usable.
+  if (_clock != kClockTSC) {
+    PerfCounter counter;
+    std::string error;
+
+    if (counter.open(error)) {
+      _clock = kClockPMC;
+    }
+    else if (_clock == kClockPMC) {
+      printf("Couldn't use the performance counter: %s\n", error.c_str());
+      return 1;
+    }
+    else {
+      if (verbose())
+        printf("Performance counter not available (%s), measuring by TSC\n", error.c_str());
+      _clock = kClockTSC;
+    }
+  }
+
+  const char* outputFileName = _cmd.valueOf("--output");
+  if (_stream) {
+    _outputFile = outputFileName ? fopen(outputFileName, "wb") : stdout;
+    if (!_outputFile) {
+      printf("Couldn't open output file: %s\n", outputFileName);
+      return 1;
+    }
+  }
+
+  if (!openSinks())
+    return 1;
+
+  if (_ndjson)
+    _json.setFormat(JSONBuilder::kFormatNDJSON);
+  else
+    _json.openObject();
 
-  _json.openObject();
   _json.beforeRecord()
        .addKey("cult")
        .openObject()
          .beforeRecord()
          .addKey("version").addStringf("%d.%d.%d", CULT_VERSION_MAJOR, CULT_VERSION_MINOR, CULT_VERSION_MICRO)
+         .beforeRecord()
+         .addKey("clock").addString(clockAsString(_clock))
        .closeObject(true);
+  flush();
 
   {
+    Profiler::Scope scope(_profiler, "CpuDetect::run");
     CpuDetect cpuDetect(this);
     cpuDetect.run();
+    _cpuFingerprint = cpuDetect.fingerprint();
   }
 
+  bool ok = true;
+
   {
+    Profiler::Scope scope(_profiler, "EnvDetect::run");
+    EnvDetect envDetect(this);
+    envDetect.run();
+  }
+
+  if (_allCores) {
+    Profiler::Scope scope(_profiler, "CoreSweep::run");
+    CoreSweep coreSweep(this);
+    coreSweep.run();
+  }
+  else if (hybrid()) {
+    ok = measureCoreTypes();
+  }
+  else {
+    Profiler::Scope scope(_profiler, "InstBench::run");
     InstBench instBench(this);
-    instBench.run();
+    ok = instBench.run();
   }
 
-  _json.nl()
-       .closeObject()
-       .nl();
+  if (_profiler.enabled()) {
+    _profiler.emit(_json, _verbose);
+    flush();
 
-  const char* outputFileName = _cmd.valueOf("--output");
-  if (outputFileName) {
+    if (!_profiler.writeTrace(_profileFile))
+      printf("Couldn't write profile to: %s\n", _profileFile);
+  }
+
+  if (!_ndjson) {
+    _json.nl()
+         .closeObject()
+         .nl();
+  }
+
+  for (std::unique_ptr<ResultSink>& sink : _sinks) {
+    if (!sink->close())
+      printf("Couldn't write results to: %s\n", sink->_fileName.c_str());
+  }
+  _sinks.clear();
+
+  if (_stream) {
+    flush();
+    if (_outputFile != stdout)
+      fclose(_outputFile);
+    _outputFile = nullptr;
+  }
+  else if (outputFileName) {
     FILE* file = fopen(outputFileName, "wb");
     if (!file) {
       printf("Couldn't open output file: %s\n", outputFileName);
@@ -94,7 +464,184 @@ int App::run() {
   else {
     puts(_output.data());
   }
-  return 0;
+
+  // The output is written even if the benchmark failed, but it's incomplete.
+  return ok ? 0 : 1;
+}
+
+// Measures specs once per core type of a hybrid CPU, on a CPU of each type starting
+// with the type of the measuring CPU, and emits a result set per type. Checkpoints
+// and verification belong to a single result set, so only the type of the measuring
+// CPU is measured with them. The time budget is split between types.
+bool App::measureCoreTypes() {
+  uint32_t cpu = _cpu;
+  double timeBudget = _timeBudget;
+  CpuUtils::CoreType primary = coreTypeOf(cpu);
+
+  std::vector<CpuUtils::CoreType> types { primary };
+  for (CpuUtils::CoreType type : _coreTypes)
+    if (type != CpuUtils::kCoreTypeUnknown && std::find(types.begin(), types.end(), type) == types.end())
+      types.push_back(type);
+
+  if (_checkpointFile || _verifyFile) {
+    if (verbose())
+      printf("Hybrid CPU: --checkpoint and --verify-against only measure %s CPUs\n\n", CpuUtils::core_type_as_string(primary));
+    types.resize(1);
+  }
+
+  Clock clock = _clock;
+  _timeBudget = timeBudget / double(types.size());
+  bool ok = true;
+
+  // NDJSON lines of each core type are top-level members tagged by the core type
+  // and CPU, nesting them in `coreTypes` would write each type as a single line.
+  bool ndjson = _json.format() == JSONBuilder::kFormatNDJSON;
+
+  if (!ndjson) {
+    _json.beforeRecord()
+         .addKey("coreTypes")
+         .openArray();
+  }
+
+  for (CpuUtils::CoreType type : types) {
+    const char* typeName = CpuUtils::core_type_as_string(type);
+
+    _measureCpus.clear();
+    for (size_t i = 0; i < _allowedCpus.size(); i++)
+      if (_coreTypes[i] == type)
+        _measureCpus.push_back(_allowedCpus[i]);
+
+    _cpu = type == primary ? cpu : _measureCpus[0];
+    _primaryCoreType = type == primary;
+    SchedUtils::setAffinity(_cpu);
+
+    if (verbose())
+      printf("Core type %s (CPU %u):\n", typeName, _cpu);
+
+    // The performance counter may not be usable by cores of every type, those
+    // are measured by TSC instead.
+    _clock = clock;
+    if (clock == kClockPMC) {
+      PerfCounter counter;
+      std::string error;
+
+      if (!counter.open(error)) {
+        if (verbose())
+          printf("  Performance counter not available on %s CPUs (%s), measuring by TSC\n", typeName, error.c_str());
+        _clock = kClockTSC;
+      }
+    }
+
+    if (ndjson) {
+      StringTmp<128> tag;
+      tag.appendFormat("\"coreType\":\"%s\",\"cpu\":%u,\"clock\":\"%s\",", typeName, _cpu, clockAsString(_clock));
+      _json.setLineTag(tag.data());
+    }
+    else {
+      _json.beforeRecord()
+           .openObject()
+             .beforeRecord()
+             .addKey("coreType").addString(typeName)
+             .beforeRecord()
+             .addKey("cpu").addUInt(_cpu)
+             .beforeRecord()
+             .addKey("clock").addString(clockAsString(_clock));
+    }
+
+    {
+      Profiler::Scope scope(_profiler, "InstBench::run", typeName);
+      InstBench instBench(this);
+      ok = instBench.run();
+    }
+
+    if (ndjson)
+      _json.setLineTag("");
+    else
+      _json.closeObject(true);
+    flush();
+
+    if (!ok)
+      break;
+  }
+
+  if (!ndjson) {
+    _json.closeArray(true);
+    flush();
+  }
+
+  _cpu = cpu;
+  _clock = clock;
+  _measureCpus = _allowedCpus;
+  _primaryCoreType = true;
+  _timeBudget = timeBudget;
+  SchedUtils::setAffinity(_cpu);
+  return ok;
+}
+
+bool App::hybrid() const {
+  CpuUtils::CoreType first = CpuUtils::kCoreTypeUnknown;
+  for (CpuUtils::CoreType type : _coreTypes) {
+    if (type == CpuUtils::kCoreTypeUnknown)
+      continue;
+
+    if (first != CpuUtils::kCoreTypeUnknown && type != first)
+      return true;
+    first = type;
+  }
+  return false;
+}
+
+CpuUtils::CoreType App::coreTypeOf(uint32_t cpu) const {
+  for (size_t i = 0; i < _allowedCpus.size() && i < _coreTypes.size(); i++)
+    if (_allowedCpus[i] == cpu)
+      return _coreTypes[i];
+  return CpuUtils::kCoreTypeUnknown;
+}
+
+const char* App::clockAsString(Clock clock) {
+  switch (clock) {
+    case kClockTSC: return "tsc";
+    case kClockPMC: return "pmc";
+    default:
+      return "auto";
+  }
+}
+
+bool App::openSinks() {
+  static const struct {
+    const char* key;
+    ResultSink::Format format;
+  } sinkOptions[] = {
+    { "--csv", ResultSink::kFormatCSV    },
+    { "--bin", ResultSink::kFormatBinary },
+    { "--xml", ResultSink::kFormatXML    }
+  };
+
+  for (const auto& option : sinkOptions) {
+    const char* fileName = _cmd.valueOf(option.key);
+    if (!fileName)
+      continue;
+
+    std::unique_ptr<ResultSink> sink(ResultSink::create(option.format));
+    if (!sink->open(fileName)) {
+      printf("Couldn't open output file: %s\n", fileName);
+      return false;
+    }
+    _sinks.push_back(std::move(sink));
+  }
+
+  return true;
+}
+
+// Writes the output produced so far when streaming, so the output can be followed
+// while the benchmark runs and the memory used by the output stays constant.
+void App::flush() {
+  if (!_outputFile || _output.empty())
+    return;
+
+  fwrite(_output.data(), _output.size(), 1, _outputFile);
+  fflush(_outputFile);
+  _output.clear();
 }
 
 } // cult namespace
@@ -2,11 +2,19 @@
 #define _CULT_APP_H
 
 #include "globals.h"
+#include "convergence.h"
+#include "cpuutils.h"
+#include "instfilter.h"
 #include "jsonbuilder.h"
+#include "profiler.h"
+#include "resultsink.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+#include <memory>
+#include <vector>
+
 namespace cult {
 
 class CmdLine {
@@ -43,12 +51,30 @@ public:
       return arg + keySize;
   }
 
+  // Appends values of all occurrences of `key=value` to `out` (options that can
+  // be repeated).
+  void valuesOf(const char* key, std::vector<const char*>& out) const {
+    size_t keySize = strlen(key);
+    for (int i = 0; i < argc; i++)
+      if (strncmp(argv[i], key, keySize) == 0 && argv[i][keySize] == '=')
+        out.push_back(argv[i] + keySize + 1);
+  }
+
   int argc;
   const char* const* argv;
 };
 
 class App {
 public:
+  // Clock used to measure kernels (`--clock`).
+  enum Clock : uint32_t {
+    kClockAuto = 0,
+    kClockTSC,
+    kClockPMC
+  };
+
+  static const char* clockAsString(Clock clock);
+
   App(int argc, char* argv[]);
   ~App();
 
@@ -58,8 +84,17 @@ public:
   inline bool dump() const { return _dump; }
   inline JSONBuilder& json() { return _json; }
 
+  // True if allowed CPUs have more than one core type (hybrid CPUs).
+  bool hybrid() const;
+  CpuUtils::CoreType coreTypeOf(uint32_t cpu) const;
+
   void parseArguments();
+  bool selectCpu();
+  void isolate();
+  bool measureCoreTypes();
   int run();
+  void flush();
+  bool openSinks();
 
   CmdLine _cmd;
   bool _help = false;
@@ -67,7 +102,61 @@ public:
   bool _round = true;
   bool _verbose = true;
   bool _estimate = false;
+  bool _pipeline = false;
+  bool _resume = false;
+  bool _stream = false;
+  bool _ndjson = false;
+  bool _calibrate = true;
+  bool _stats = false;
+  bool _snap = false;
+  bool _detectNoise = false;
+  bool _isolate = false;
+  bool _allCores = false;
+  bool _realtime = false;
+  bool _memoryLocked = false;
   uint32_t _singleInstId = 0;
+  // CPU the main thread is pinned to and measures on (`--cpu`) and how it was
+  // selected ("option", "least-interrupted" or "default").
+  uint32_t _cpu = 0;
+  const char* _cpuSource = "default";
+  const char* _cpuOption = nullptr;
+  // CPUs the process was allowed to run on before the main thread was pinned.
+  std::vector<uint32_t> _allowedCpus;
+  // Core type of each CPU of `_allowedCpus` (in the same order) detected by
+  // CpuDetect, all unknown unless the CPU is hybrid.
+  std::vector<CpuUtils::CoreType> _coreTypes;
+  // CPUs used by `--jobs`, allowed CPUs of the core type being measured.
+  std::vector<uint32_t> _measureCpus;
+  // False while measuring a core type other than the one of `_cpu`, results of
+  // which are not written to sinks.
+  bool _primaryCoreType = true;
+  uint32_t _jobs = 1;
+  uint32_t _batchSize = 16;
+  uint32_t _repeat = 0;
+  Clock _clock = kClockAuto;
+  Convergence::Params _precision {};
+  InstFilter _filter;
+  const char* _checkpointFile = nullptr;
+  const char* _verifyFile = nullptr;
+  const char* _planFile = nullptr;
+  const char* _weightsFile = nullptr;
+  const char* _listingFile = nullptr;
+  double _timeBudget = 0.0;
+  double _verifyThreshold = 0.1;
+  double _maxCv = 0.05;
+  uint64_t _cpuFingerprint = 0;
+  CpuUtils::TscInfo _tsc {};
+
+  // Profiles cult's own phases (`--profile-self`) and writes a Chrome trace.
+  Profiler _profiler;
+  const char* _profileFile = nullptr;
+
+  // Output file when streaming (`--stream`), otherwise the output is written at
+  // the end of `run()`.
+  FILE* _outputFile = nullptr;
+
+  // Additional outputs (`--csv`, `--bin`, `--xml`).
+  std::vector<std::unique_ptr<ResultSink>> _sinks;
 
   String _output;
   JSONBuilder _json;
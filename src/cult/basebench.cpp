@@ -2,30 +2,19 @@
 
 namespace cult {
 
-class SimpleErrorHandler : public ErrorHandler {
-public:
-  inline SimpleErrorHandler() : _err(kErrorOk) {}
-
-  void handleError(Error err, const char * message, BaseEmitter * origin) override {
-    _err = err;
-    printf("Assembler Error: %s\n", message);
-  }
-
-  Error _err;
-};
+// Number of attempts to take a batch of samples while the performance counter
+// is moved to another hardware counter (or isn't scheduled) before giving up.
+static constexpr uint32_t kMaxCounterRetries = 1000;
 
 BaseBench::BaseBench(App* app)
   : _app(app),
+    _clock(app->_clock),
     _runtime(),
-    _cpuInfo(CpuInfo::host()) {}
+    _cpuInfo(CpuInfo::host()),
+    _counterFailed(false) {}
 BaseBench::~BaseBench() {}
 
-BaseBench::Func BaseBench::compileFunc() {
-  FileLogger logger(stdout);
-  SimpleErrorHandler eh;
-
-  CodeHolder code;
-
+void BaseBench::initCode(CodeHolder& code, FileLogger& logger, SimpleErrorHandler& eh) {
   code.init(_runtime.environment());
   code.setErrorHandler(&eh);
 
@@ -33,11 +22,18 @@ BaseBench::Func BaseBench::compileFunc() {
     logger.addFlags(FormatFlags::kMachineCode | FormatFlags::kExplainImms);
     code.setLogger(&logger);
   }
+}
 
-  x86::Assembler a(&code);
+// Emits a complete benchmark function at the current position and returns its
+// entry. Each function starts at a 64-byte boundary so the code of a function
+// (including the alignment of its inner loop) doesn't depend on where it's placed.
+Label BaseBench::emitFunc(x86::Assembler& a) {
+  Label entry = a.newLabel();
+  a.align(AlignMode::kCode, 64);
+  a.bind(entry);
 
   FuncDetail fd;
-  fd.init(FuncSignatureT<void, uint32_t, uint64_t*>(CallConvId::kCDecl), code.environment());
+  fd.init(FuncSignatureT<void, uint32_t, uint64_t*, uint32_t, uint32_t>(CallConvId::kCDecl), a.environment());
 
   FuncFrame frame;
   frame.init(fd);
@@ -54,26 +50,54 @@ BaseBench::Func BaseBench::compileFunc() {
   x86::Mem mOut      = stack; stack.addOffset(a.registerSize());
   x86::Mem mCyclesLo = stack; stack.addOffset(4);
   x86::Mem mCyclesHi = stack; stack.addOffset(4);
+  x86::Mem mIter     = stack; stack.addOffset(4);
+  x86::Mem mSamples  = stack; stack.addOffset(4);
+  x86::Mem mCounter  = stack; stack.addOffset(4);
+
+  mSamples.setSize(4);
+  mCounter.setSize(4);
 
   x86::Gp rCnt = x86::ebp;                 // Cannot be EAX|EBX|ECX|EDX as these are clobbered by CPUID.
   x86::Gp rOut = a.zbx();                  // Cannot be ESI|EDI as these are used by the cycle counter.
+  x86::Gp rSamples = x86::esi;             // Only used to pass the argument, saved to the stack.
+  x86::Gp rCounter = x86::edi;             // Only used to pass the argument, saved to the stack.
+
+  bool usePMC = _clock == App::kClockPMC;
 
   FuncArgsAssignment args(&fd);
-  args.assignAll(rCnt, rOut);
+  args.assignAll(rCnt, rOut, rSamples, rCounter);
   args.updateFuncFrame(frame);
   frame.finalize();
 
+  Label L_Sample = a.newLabel();
+
   // --- Function prolog ---
   a.emitProlog(frame);
   a.emitArgsAssignment(frame, args);
 
   // --- Benchmark prolog ---
   a.mov(mOut, rOut);
+  a.mov(mIter, rCnt);
+  a.mov(mSamples, rSamples);
+  a.mov(mCounter, rCounter);
   beforeBody(a);
 
+  // --- Sample loop ---
+  //
+  // Each sample runs the whole body, so the iteration counter has to be reloaded
+  // as the body decrements it.
+  a.bind(L_Sample);
+  a.mov(rCnt, mIter);
+
   a.xor_(x86::eax, x86::eax);
   a.cpuid();
-  a.rdtsc();
+  if (usePMC) {
+    a.mov(x86::ecx, mCounter);
+    a.rdpmc();
+  }
+  else {
+    a.rdtsc();
+  }
   a.mov(mCyclesLo, x86::eax);
   a.mov(mCyclesHi, x86::edx);
 
@@ -81,7 +105,19 @@ BaseBench::Func BaseBench::compileFunc() {
   compileBody(a, rCnt);
 
   // --- Benchmark epilog ---
-  if (x86Features().hasRDTSCP()) {
+  if (usePMC) {
+    // RDPMC is not serializing - wait for the body to retire before reading the
+    // counter and don't let the next sample start before it's read.
+    if (x86Features().hasSSE2())
+      a.lfence();
+    a.mov(x86::ecx, mCounter);
+    a.rdpmc();
+    a.mov(x86::esi, x86::eax);
+    a.mov(x86::edi, x86::edx);
+    a.xor_(x86::eax, x86::eax);
+    a.cpuid();
+  }
+  else if (x86Features().hasRDTSCP()) {
     a.rdtscp();
     a.mov(x86::esi, x86::eax);
     a.mov(x86::edi, x86::edx);
@@ -103,21 +139,71 @@ BaseBench::Func BaseBench::compileFunc() {
   a.mov(x86::ptr(rOut, 0), x86::esi);
   a.mov(x86::ptr(rOut, 4), x86::edi);
 
+  a.add(rOut, 8);
+  a.mov(mOut, rOut);
+  a.sub(mSamples, 1);
+  a.jnz(L_Sample);
+
   // --- Function epilog ---
   afterBody(a);
   a.emitEpilog(frame);
-  code.detach(&a);
 
-  if (eh._err)
+  return entry;
+}
+
+void* BaseBench::addCode(CodeHolder& code) {
+  void* p = nullptr;
+  if (_runtime.add(&p, &code) != kErrorOk)
     return nullptr;
+  return p;
+}
 
-  Func func;
-  _runtime.add(&func, &code);
-  return func;
+void BaseBench::releaseCode(void* p) {
+  _runtime.release(p);
 }
 
-void BaseBench::releaseFunc(Func func) {
-  _runtime.release(func);
+bool BaseBench::runFunc(Func func, uint32_t nIter, uint64_t* out, uint32_t nSamples) {
+  if (_clock != App::kClockPMC) {
+    func(nIter, out, nSamples, 0);
+    return true;
+  }
+
+  if (_counterFailed)
+    return false;
+
+  if (!_counter.isOpen()) {
+    std::string error;
+    if (!_counter.open(error)) {
+      printf("Couldn't open the performance counter of a measuring thread: %s\n", error.c_str());
+      _counterFailed = true;
+      return false;
+    }
+  }
+
+  // The counter may move to another hardware counter when the thread gets
+  // rescheduled, in which case the batch is taken again as some of its samples
+  // could have been read from a wrong counter.
+  uint32_t retry = 0;
+  for (;;) {
+    uint32_t index = _counter.index();
+    if (index != PerfCounter::kInvalidIndex) {
+      func(nIter, out, nSamples, index);
+      if (_counter.index() == index)
+        break;
+    }
+
+    if (++retry == kMaxCounterRetries) {
+      printf("The performance counter of a measuring thread is not scheduled\n");
+      _counterFailed = true;
+      return false;
+    }
+  }
+
+  // Counters are narrower than 64 bits, so a difference of two reads wraps.
+  uint64_t mask = _counter.mask();
+  for (uint32_t i = 0; i < nSamples; i++)
+    out[i] &= mask;
+  return true;
 }
 
 } // cult namespace
@@ -2,30 +2,65 @@
 #define _CULT_BASEBENCH_H
 
 #include "app.h"
+#include "perfcounter.h"
 
 namespace cult {
 
+class SimpleErrorHandler : public ErrorHandler {
+public:
+  inline SimpleErrorHandler() : _err(kErrorOk) {}
+
+  void handleError(Error err, const char * message, BaseEmitter * origin) override {
+    _err = err;
+    printf("Assembler Error: %s\n", message);
+  }
+
+  Error _err;
+};
+
 class BaseBench {
 public:
-  typedef void (*Func)(uint32_t nIter, uint64_t* out);
+  // Benchmark function - runs the benchmarked body `nSamples` times (must be at
+  // least 1), each time with `nIter` iterations, and stores the number of cycles
+  // of each run to `out[0..nSamples-1]`. Cycles are read by RDPMC from `counter`
+  // when measuring by the performance counter, otherwise `counter` is ignored.
+  typedef void (*Func)(uint32_t nIter, uint64_t* out, uint32_t nSamples, uint32_t counter);
 
   BaseBench(App* app);
   virtual ~BaseBench();
 
   inline const CpuFeatures::X86& x86Features() const { return _cpuInfo.features().x86(); }
 
-  Func compileFunc();
-  void releaseFunc(Func func);
+  // Multiple benchmark functions can be emitted into a single code buffer, each
+  // having its own entry label, and then added to the runtime at once.
+  void initCode(CodeHolder& code, FileLogger& logger, SimpleErrorHandler& eh);
+  Label emitFunc(x86::Assembler& a);
+  void* addCode(CodeHolder& code);
+  void releaseCode(void* p);
+
+  // Calls `func` on the current thread - always use this instead of calling it
+  // directly as it provides the performance counter (see `App::kClockPMC`).
+  // Returns false if the performance counter can't be used, in which case no
+  // further functions run and `_counterFailed` is set.
+  bool runFunc(Func func, uint32_t nIter, uint64_t* out, uint32_t nSamples);
 
-  virtual void run() = 0;
+  // Runs the benchmark, returns false if it failed (the reason is printed).
+  virtual bool run() = 0;
   virtual void beforeBody(x86::Assembler& a) = 0;
   virtual void compileBody(x86::Assembler& a, x86::Gp rCnt) = 0;
   virtual void afterBody(x86::Assembler& a) = 0;
 
   App* _app;
+  // Clock used by functions emitted by this bench, `_app->_clock` unless changed
+  // before emitting them (see `CoreSweep`).
+  App::Clock _clock;
 
   JitRuntime _runtime;
   CpuInfo _cpuInfo;
+
+  // Opened by the first `runFunc()` as it has to be opened by the measuring thread.
+  PerfCounter _counter;
+  bool _counterFailed;
 };
 
 } // cult namespace
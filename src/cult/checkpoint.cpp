@@ -0,0 +1,188 @@
+#include "checkpoint.h"
+#include "instbench.h"
+
+#include <string.h>
+
+namespace cult {
+
+Checkpoint::Checkpoint()
+  : _file(nullptr) {}
+
+Checkpoint::~Checkpoint() {
+  close();
+}
+
+// Replaces `to` by `from`, which doesn't leave `to` truncated or half written
+// if the process dies in the middle.
+static bool replaceFile(const char* from, const char* to) {
+#if defined(_WIN32)
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  return rename(from, to) == 0;
+#endif
+}
+
+bool Checkpoint::open(const char* fileName, const Key& key, bool resume, std::vector<InstResult>& loaded) {
+  close();
+
+  FILE* file = fopen(fileName, "rb");
+  if (file) {
+    bool matches = _matches(file, key);
+    if (matches && resume)
+      _load(file, loaded);
+    fclose(file);
+
+    if (!matches) {
+      printf("Checkpoint '%s' was written on a different CPU, by a different version or with different settings (precision, clock, calibration or rounding)\n", fileName);
+      printf("Remove it or use a different --checkpoint file\n");
+      return false;
+    }
+  }
+
+  // The kept results are written to a temporary file, which then replaces the
+  // checkpoint, so a partially written record of a previous run doesn't corrupt
+  // records that follow and the checkpoint is never lost if we die meanwhile.
+  std::string tmpName = std::string(fileName) + ".tmp";
+
+  _file = fopen(tmpName.c_str(), "wb");
+  if (!_file) {
+    printf("Couldn't open checkpoint file: %s\n", tmpName.c_str());
+    return false;
+  }
+
+  _writeHeader(key);
+  for (const InstResult& result : loaded)
+    _writeResult(result);
+
+  bool written = fflush(_file) == 0 && !ferror(_file);
+  written &= fclose(_file) == 0;
+  _file = nullptr;
+
+  if (!written || !replaceFile(tmpName.c_str(), fileName)) {
+    printf("Couldn't write checkpoint file: %s\n", fileName);
+    remove(tmpName.c_str());
+    return false;
+  }
+
+  _file = fopen(fileName, "ab");
+  if (!_file) {
+    printf("Couldn't open checkpoint file: %s\n", fileName);
+    return false;
+  }
+
+  return true;
+}
+
+void Checkpoint::close() {
+  if (_file) {
+    fclose(_file);
+    _file = nullptr;
+  }
+}
+
+void Checkpoint::add(const InstResult& result) {
+  if (!_file)
+    return;
+
+  _writeResult(result);
+  fflush(_file);
+}
+
+std::string Checkpoint::keyOf(const InstResult& result) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%u:%016llX", unsigned(result.instId), (unsigned long long)result.instSpec.value);
+  return std::string(buf);
+}
+
+bool Checkpoint::_matches(FILE* file, const Key& key) {
+  char line[512];
+
+  unsigned version = 0;
+  unsigned long long fingerprint = 0;
+  unsigned asmjitVersion = 0;
+  double tolerance = 0.0;
+  double confidence = 0.0;
+  unsigned minSamples = 0;
+  unsigned maxSamples = 0;
+  char clock[16] = {};
+  unsigned calibrate = 0;
+  unsigned round = 0;
+  unsigned snap = 0;
+
+  if (!fgets(line, sizeof(line), file))
+    return false;
+
+  return sscanf(line, "cult-checkpoint %u %llX %X %lf %lf %u %u %15s %u %u %u",
+                &version, &fingerprint, &asmjitVersion,
+                &tolerance, &confidence, &minSamples, &maxSamples,
+                clock, &calibrate, &round, &snap) == 11 &&
+         version == kVersion &&
+         fingerprint == key.fingerprint &&
+         asmjitVersion == ASMJIT_LIBRARY_VERSION &&
+         tolerance == key.precision.tolerance &&
+         confidence == key.precision.confidence &&
+         minSamples == key.precision.minSamples &&
+         maxSamples == key.precision.maxSamples &&
+         strcmp(clock, key.clock) == 0 &&
+         calibrate == unsigned(key.calibrate) &&
+         round == unsigned(key.round) &&
+         snap == unsigned(key.snap);
+}
+
+void Checkpoint::_load(FILE* file, std::vector<InstResult>& loaded) {
+  char line[512];
+
+  while (fgets(line, sizeof(line), file)) {
+    unsigned instId;
+    unsigned long long instSpec;
+    unsigned samples;
+    unsigned nIter;
+    double lat;
+    double rcp;
+    double confidence;
+    double latNs;
+    double rcpNs;
+
+    // Incomplete records (the process died while writing them) are ignored.
+    if (!strchr(line, '\n'))
+      break;
+
+    if (sscanf(line, "%u %llX %lf %lf %u %u %lf %lf %lf", &instId, &instSpec, &lat, &rcp, &samples, &nIter, &confidence, &latNs, &rcpNs) != 9)
+      continue;
+
+    if (instId == 0 || instId >= x86::Inst::_kIdCount)
+      continue;
+
+    loaded.push_back(InstResult { InstId(instId), InstSpec { uint64_t(instSpec) }, lat, rcp, samples, nIter, confidence, latNs, rcpNs, {}, {}, {}, {}, 0, 0.0, 0.0, false, 0.0, false });
+  }
+}
+
+void Checkpoint::_writeHeader(const Key& key) {
+  fprintf(_file, "cult-checkpoint %u %016llX %06X %.17g %.17g %u %u %s %u %u %u\n",
+    unsigned(kVersion),
+    (unsigned long long)key.fingerprint,
+    unsigned(ASMJIT_LIBRARY_VERSION),
+    key.precision.tolerance,
+    key.precision.confidence,
+    unsigned(key.precision.minSamples),
+    unsigned(key.precision.maxSamples),
+    key.clock,
+    unsigned(key.calibrate),
+    unsigned(key.round),
+    unsigned(key.snap));
+}
+
+void Checkpoint::_writeResult(const InstResult& result) {
+  fprintf(_file, "%u %016llX %.17g %.17g %u %u %.17g %.17g %.17g\n",
+    unsigned(result.instId),
+    (unsigned long long)result.instSpec.value,
+    result.lat,
+    result.rcp,
+    unsigned(result.samples),
+    unsigned(result.nIter),
+    result.confidence,
+    result.latNs,
+    result.rcpNs);
+}
+
+} // cult namespace
@@ -0,0 +1,63 @@
+#ifndef _CULT_CHECKPOINT_H
+#define _CULT_CHECKPOINT_H
+
+#include "globals.h"
+#include "convergence.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace cult {
+
+struct InstResult;
+
+// Persists results of finished specs so a run that dies partway can be resumed
+// by `--resume`. The file is a text file having a header, which identifies the
+// CPU (CPUID fingerprint), AsmJit version (instruction ids) and the settings
+// the results were measured with, and one line per result, which is flushed as
+// soon as the result is known.
+class Checkpoint {
+public:
+  enum : uint32_t { kVersion = 5 };
+
+  // Everything stored results depend on - results can only be resumed by a run
+  // having the same key.
+  struct Key {
+    uint64_t fingerprint;
+    Convergence::Params precision;
+    // Clock (`tsc` or `pmc`), whether TSC ticks are calibrated to core cycles
+    // and how results are rounded.
+    const char* clock;
+    bool calibrate;
+    bool round;
+    bool snap;
+  };
+
+  Checkpoint();
+  ~Checkpoint();
+
+  inline bool isOpen() const { return _file != nullptr; }
+
+  // Opens the checkpoint `fileName` for writing. When `resume` is true, results
+  // stored in the existing file are loaded into `loaded` and kept in the file.
+  // An existing file written by a different version or having a different `key`
+  // is never overwritten - opening it fails instead.
+  bool open(const char* fileName, const Key& key, bool resume, std::vector<InstResult>& loaded);
+  void close();
+
+  void add(const InstResult& result);
+
+  static std::string keyOf(const InstResult& result);
+
+  bool _matches(FILE* file, const Key& key);
+  void _load(FILE* file, std::vector<InstResult>& loaded);
+  void _writeHeader(const Key& key);
+  void _writeResult(const InstResult& result);
+
+  FILE* _file;
+};
+
+} // cult namespace
+
+#endif // _CULT_CHECKPOINT_H
@@ -0,0 +1,82 @@
+#include "convergence.h"
+
+#include <math.h>
+
+namespace cult {
+
+Convergence::Convergence() {
+  reset(Params { 0.005, 0.999, 1, 1000000 });
+}
+
+Convergence::Params Convergence::defaultParams(bool estimate) {
+  Params params;
+  params.tolerance = estimate ? 0.02 : 0.005;
+  params.confidence = estimate ? 0.95 : 0.999;
+  params.minSamples = estimate ? 50 : 200;
+  params.maxSamples = 1000000;
+  return params;
+}
+
+void Convergence::reset(const Params& params) {
+  _params = params;
+
+  double confidence = std::min(std::max(params.confidence, 0.0), 0.999999);
+  _requiredHits = std::max<uint32_t>(uint32_t(ceil(kRareness * -log(1.0 - confidence))), 1u);
+
+  _best = ~uint64_t(0);
+  _anchor = ~uint64_t(0);
+  _samples = 0;
+  _hits = 0;
+  _reason = kStopNone;
+}
+
+bool Convergence::add(uint64_t sample) {
+  _samples++;
+
+  if (sample < _best)
+    _best = sample;
+
+  uint64_t band = uint64_t(double(_best) * _params.tolerance);
+
+  if (_anchor == ~uint64_t(0) || sample + band < _anchor) {
+    // Significant improvement - the previous hits were not near the minimum.
+    _anchor = sample;
+    _hits = 1;
+  }
+  else if (sample <= _best + band) {
+    _hits++;
+  }
+
+  if (_samples >= _params.maxSamples) {
+    _reason = kStopMaxSamples;
+    return true;
+  }
+
+  if (_samples >= _params.minSamples && _hits >= _requiredHits) {
+    _reason = kStopConverged;
+    return true;
+  }
+
+  return false;
+}
+
+void Convergence::stopAtDeadline() {
+  if (_reason == kStopNone)
+    _reason = kStopDeadline;
+}
+
+double Convergence::confidence() const {
+  return 1.0 - exp(-double(_hits) / kRareness);
+}
+
+const char* Convergence::reasonAsString(StopReason reason) {
+  switch (reason) {
+    case kStopConverged : return "converged";
+    case kStopMaxSamples: return "max-samples";
+    case kStopDeadline  : return "deadline";
+    default:
+      return "none";
+  }
+}
+
+} // cult namespace
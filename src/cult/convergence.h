@@ -0,0 +1,74 @@
+#ifndef _CULT_CONVERGENCE_H
+#define _CULT_CONVERGENCE_H
+
+#include "globals.h"
+
+namespace cult {
+
+// Decides when the minimum of a series of timing samples is known well enough
+// to stop sampling.
+//
+// Samples that land within `tolerance` of the current minimum are "hits". Each
+// improvement of the minimum by more than `tolerance` restarts the counting. If
+// there was a lower mode that is at most `kRareness` times rarer than the current
+// minimum, it would have been observed with probability `1 - exp(-hits / kRareness)`,
+// thus we stop once this probability reaches the requested `confidence`.
+class Convergence {
+public:
+  enum StopReason : uint32_t {
+    kStopNone = 0,
+    kStopConverged,
+    kStopMaxSamples,
+    kStopDeadline
+  };
+
+  struct Params {
+    // Relative tolerance of the minimum (0.005 means 0.5%).
+    double tolerance;
+    // Required confidence that the minimum won't improve beyond `tolerance`.
+    double confidence;
+    // Minimum and maximum number of samples.
+    uint32_t minSamples;
+    uint32_t maxSamples;
+  };
+
+  static constexpr double kRareness = 10.0;
+
+  Convergence();
+
+  // Default parameters of a full run and of an `--estimate` run.
+  static Params defaultParams(bool estimate);
+
+  void reset(const Params& params);
+
+  // Adds a sample, returns true if the minimum converged or the maximum number
+  // of samples was reached.
+  bool add(uint64_t sample);
+
+  // Stops sampling before the minimum converged as the time given to the test
+  // ran out (see `--time-budget`).
+  void stopAtDeadline();
+
+  inline uint64_t best() const { return _best; }
+  inline uint32_t samples() const { return _samples; }
+  inline uint32_t hits() const { return _hits; }
+  inline StopReason reason() const { return _reason; }
+
+  // Confidence reached so far, see the class description.
+  double confidence() const;
+
+  static const char* reasonAsString(StopReason reason);
+
+  Params _params;
+  uint32_t _requiredHits;
+
+  uint64_t _best;
+  uint64_t _anchor;
+  uint32_t _samples;
+  uint32_t _hits;
+  StopReason _reason;
+};
+
+} // cult namespace
+
+#endif // _CULT_CONVERGENCE_H
@@ -0,0 +1,178 @@
+#include "coresweep.h"
+#include "schedutils.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace cult {
+
+// Canary specs measured on each CPU - chains of simple integer, multiplier, load
+// and SIMD instructions that are available on every x86 CPU that can run cult,
+// otherwise they are skipped.
+static const struct {
+  uint32_t instId;
+  uint32_t o0;
+  uint32_t o1;
+} kCanaries[] = {
+  { x86::Inst::kIdAdd  , InstSpec::kOpGpd, InstSpec::kOpGpd   },
+  { x86::Inst::kIdImul , InstSpec::kOpGpd, InstSpec::kOpGpd   },
+  { x86::Inst::kIdMov  , InstSpec::kOpGpd, InstSpec::kOpMem32 },
+  { x86::Inst::kIdPaddd, InstSpec::kOpXmm, InstSpec::kOpXmm   },
+  { x86::Inst::kIdAddsd, InstSpec::kOpXmm, InstSpec::kOpXmm   },
+  { x86::Inst::kIdMulsd, InstSpec::kOpXmm, InstSpec::kOpXmm   }
+};
+
+// Cycles of the `add` chain used to measure the core/TSC ratio of each CPU.
+static constexpr double kRatioAddCycles = 1.0;
+
+CoreSweep::CoreSweep(App* app)
+  : _app(app) {}
+CoreSweep::~CoreSweep() {}
+
+void CoreSweep::run() {
+  std::vector<InstResult> canaries;
+  {
+    InstBench bench(_app);
+    for (const auto& canary : kCanaries) {
+      InstSpec instSpec = InstSpec::pack(canary.o0, canary.o1);
+
+      std::vector<InstSpec> specs;
+      bench.classify(specs, canary.instId);
+
+      bool found = false;
+      for (InstSpec spec : specs)
+        found |= spec.value == instSpec.value;
+
+      if (found)
+        canaries.push_back(InstResult { canary.instId, instSpec, 0.0, 0.0, 0, 0, 0.0, 0.0, 0.0, {}, {}, {}, {}, 0, 0.0, 0.0, false, 0.0, false });
+    }
+  }
+
+  if (canaries.empty()) {
+    printf("None of the canary specs can run on this CPU\n");
+    return;
+  }
+
+  const std::vector<uint32_t>& cpus = _app->_allowedCpus;
+  if (_app->verbose())
+    printf("Core sweep (%u canaries on %u CPUs):\n", unsigned(canaries.size()), unsigned(cpus.size()));
+
+  _results.clear();
+  for (uint32_t cpu : cpus) {
+    CoreSweepResult result {};
+    result.cpu = cpu;
+    result.coreType = _app->coreTypeOf(cpu);
+    result.canaries = canaries;
+
+    SchedUtils::setAffinity(cpu);
+    _measureCpu(result);
+    _results.push_back(result);
+
+    if (_app->verbose())
+      printf("  CPU %u: %.2f cycles, core/TSC ratio %.4f\n", result.cpu, result.cycles, result.ratio);
+  }
+
+  SchedUtils::setAffinity(_app->_cpu);
+
+  // The median of an even number of CPUs is the lower of the middle two.
+  std::vector<double> ticks;
+  for (const CoreSweepResult& result : _results)
+    ticks.push_back(result.ticks);
+
+  std::sort(ticks.begin(), ticks.end());
+  double median = ticks[(ticks.size() - 1) / 2];
+
+  for (CoreSweepResult& result : _results)
+    result.deviation = median > 0.0 ? result.ticks / median - 1.0 : 0.0;
+
+  _emit();
+}
+
+// Measures the core/TSC ratio and all canaries on the CPU the thread is pinned to.
+// The ratio is always measured by TSC, canaries by the clock of the run, so they
+// are in core cycles either directly (PMC) or after calibration (TSC).
+void CoreSweep::_measureCpu(CoreSweepResult& result) {
+  InstBench clockBench(_app);
+  clockBench._clock = App::kClockTSC;
+
+  double add = clockBench.measureChain(x86::Inst::kIdAdd, InstSpec::pack(InstSpec::kOpGpd, InstSpec::kOpGpd));
+  result.ratio = add > 0.0 ? kRatioAddCycles / add : 0.0;
+
+  InstBench bench(_app);
+  result.cycles = 0.0;
+
+  for (InstResult& canary : result.canaries) {
+    bench.measure(canary);
+    result.cycles += canary.lat;
+  }
+
+  // Canaries are in TSC ticks already if the run doesn't calibrate them.
+  if (!bench._calibrate && bench._clock == App::kClockTSC)
+    result.ticks = result.cycles;
+  else
+    result.ticks = result.ratio > 0.0 ? result.cycles / result.ratio : 0.0;
+}
+
+void CoreSweep::_emit() {
+  JSONBuilder& json = _app->json();
+  const std::vector<InstResult>& canaries = _results[0].canaries;
+
+  if (_app->verbose()) {
+    printf("\n");
+    printf("CPU   | Type    | Cycles   | Ratio  | Deviation\n");
+    for (const CoreSweepResult& result : _results)
+      printf("%-5u | %-7s | %8.2f | %6.4f | %+7.2f%%\n", result.cpu, CpuUtils::core_type_as_string(result.coreType), result.cycles, result.ratio, result.deviation * 100.0);
+    printf("\n");
+  }
+
+  json.beforeRecord()
+      .addKey("coreSweep")
+      .openObject()
+        .beforeRecord()
+        .addKey("canaries")
+        .openArray();
+
+  for (const InstResult& canary : canaries) {
+    StringTmp<256> sb;
+    InstBench::formatSpec(sb, canary.instId, canary.instSpec);
+    json.beforeRecord().addString(sb.data());
+  }
+
+  json.closeArray(true)
+      .beforeRecord()
+      .addKey("cores")
+      .openArray();
+
+  for (const CoreSweepResult& result : _results) {
+    json.beforeRecord()
+        .openObject()
+        .addKey("cpu").addUInt(result.cpu);
+
+    if (_app->hybrid())
+      json.addKey("coreType").addString(CpuUtils::core_type_as_string(result.coreType));
+
+    json.addKey("ratio").addDoublef("%.4f", result.ratio)
+        .addKey("cycles").addDoublef("%.2f", result.cycles)
+        .addKey("ticks").addDoublef("%.2f", result.ticks)
+        .addKey("deviation").addDoublef("%.4f", result.deviation)
+        .addKey("lat").openArray();
+
+    for (const InstResult& canary : result.canaries)
+      json.addDoublef("%.2f", canary.lat);
+
+    json.closeArray()
+        .addKey("rcp").openArray();
+
+    for (const InstResult& canary : result.canaries)
+      json.addDoublef("%.2f", canary.rcp);
+
+    json.closeArray()
+        .closeObject();
+  }
+
+  json.closeArray(true)
+      .closeObject(true);
+}
+
+} // cult namespace
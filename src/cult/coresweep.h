@@ -0,0 +1,51 @@
+#ifndef _CULT_CORESWEEP_H
+#define _CULT_CORESWEEP_H
+
+#include "app.h"
+#include "instbench.h"
+
+#include <vector>
+
+namespace cult {
+
+// ============================================================================
+// [cult::CoreSweep]
+// ============================================================================
+
+// Result of canary specs measured on a single CPU.
+struct CoreSweepResult {
+  uint32_t cpu;
+  CpuUtils::CoreType coreType;
+  // Core cycles per TSC tick measured by the `add` chain, zero if unknown.
+  double ratio;
+  // Sum of latencies of all canaries in core cycles (TSC ticks with
+  // `--no-calibration`) and the same converted to TSC ticks, which compares
+  // the time the canaries take on each CPU.
+  double cycles;
+  double ticks;
+  // Relative difference of `ticks` from the median CPU, positive if slower.
+  double deviation;
+  std::vector<InstResult> canaries;
+};
+
+// Measures a fixed subset of specs (canaries) on every CPU the process can run
+// on (`--all-cores`) to find CPUs running at a different frequency than others,
+// like favored cores of server parts or cores of a different type. CPUs are
+// measured one at a time, each by its own InstBench.
+class CoreSweep {
+public:
+  CoreSweep(App* app);
+  ~CoreSweep();
+
+  void run();
+
+  void _measureCpu(CoreSweepResult& result);
+  void _emit();
+
+  App* _app;
+  std::vector<CoreSweepResult> _results;
+};
+
+} // cult namespace
+
+#endif // _CULT_CORESWEEP_H
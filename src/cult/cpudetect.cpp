@@ -1,4 +1,7 @@
 #include "cpudetect.h"
+#include "schedutils.h"
+
+#include <algorithm>
 
 namespace cult {
 
@@ -25,6 +28,8 @@ CpuDetect::~CpuDetect() {}
 void CpuDetect::run() {
   _queryCpuData();
   _queryCpuInfo();
+  _queryTscInfo();
+  _queryCoreTypes();
 }
 
 void CpuDetect::_queryCpuData() {
@@ -373,7 +378,132 @@ void CpuDetect::_queryCpuInfo() {
         .beforeRecord().addKey("modelId").addStringf("0x%02X", _modelId)
         .beforeRecord().addKey("familyId").addStringf("0x%0002X", _familyId)
         .beforeRecord().addKey("steppingId").addStringf("0x%02X", _steppingId)
+        .beforeRecord().addKey("fingerprint").addStringf("0x%016llX", (unsigned long long)fingerprint())
+      .closeObject(true);
+  _app->flush();
+
+  SinkCpuInfo info { _vendorName, _brandString, _uarchName, _familyId, _modelId, _steppingId, fingerprint() };
+  for (std::unique_ptr<ResultSink>& sink : _app->_sinks)
+    sink->addCpuInfo(info);
+}
+
+void CpuDetect::_queryTscInfo() {
+  CpuUtils::TscInfo& tsc = _app->_tsc;
+  CpuUtils::get_tsc_info(&tsc);
+
+  const char* source = CpuUtils::tsc_source_as_string(tsc.source);
+  const char* confidence = CpuUtils::tsc_confidence_as_string(tsc.confidence);
+
+  if (_app->verbose()) {
+    printf("TSC:\n");
+    printf("  Frequency: %llu Hz (%s, %s confidence)\n", (unsigned long long)tsc.freq, source, confidence);
+    printf("  Invariant: %s\n", tsc.invariant ? "yes" : "no");
+    if (!tsc.invariant)
+      printf("  WARNING: TSC is not invariant, times converted from TSC are not reliable\n");
+    printf("\n");
+  }
+
+  JSONBuilder& json = _app->json();
+  json.beforeRecord()
+      .addKey("tsc")
+      .openObject()
+        .beforeRecord().addKey("frequency").addUInt(tsc.freq)
+        .beforeRecord().addKey("source").addString(source)
+        .beforeRecord().addKey("confidence").addString(confidence)
+        .beforeRecord().addKey("invariant").addBool(tsc.invariant)
       .closeObject(true);
+  _app->flush();
+}
+
+// Detects the core type of each allowed CPU by CPUID.1Ah executed on that CPU,
+// and by PMUs Linux exposes for each core type of hybrid CPUs (`cpu_core` and
+// `cpu_atom` in /sys/devices), which also works when a hypervisor hides the
+// leaf. CPUID wins if they disagree. Nothing is emitted if the CPU isn't hybrid.
+void CpuDetect::_queryCoreTypes() {
+  const std::vector<uint32_t>& cpus = _app->_allowedCpus;
+  std::vector<CpuUtils::CoreType>& types = _app->_coreTypes;
+  types.assign(cpus.size(), CpuUtils::kCoreTypeUnknown);
+
+  bool cpuid = CpuUtils::get_core_type() != CpuUtils::kCoreTypeUnknown;
+  if (cpuid) {
+    for (size_t i = 0; i < cpus.size(); i++) {
+      SchedUtils::setAffinity(cpus[i]);
+      types[i] = CpuUtils::get_core_type();
+    }
+    SchedUtils::setAffinity(_app->_cpu);
+  }
+
+  std::vector<uint32_t> pCores;
+  std::vector<uint32_t> eCores;
+  bool sysfs = SchedUtils::readCpuList("/sys/devices/cpu_core/cpus", pCores) &&
+               SchedUtils::readCpuList("/sys/devices/cpu_atom/cpus", eCores);
+
+  uint32_t mismatches = 0;
+  if (sysfs) {
+    for (size_t i = 0; i < cpus.size(); i++) {
+      CpuUtils::CoreType type = CpuUtils::kCoreTypeUnknown;
+      if (std::find(pCores.begin(), pCores.end(), cpus[i]) != pCores.end())
+        type = CpuUtils::kCoreTypeCore;
+      else if (std::find(eCores.begin(), eCores.end(), cpus[i]) != eCores.end())
+        type = CpuUtils::kCoreTypeAtom;
+
+      if (types[i] == CpuUtils::kCoreTypeUnknown)
+        types[i] = type;
+      else if (type != CpuUtils::kCoreTypeUnknown && type != types[i])
+        mismatches++;
+    }
+  }
+
+  if (!_app->hybrid())
+    return;
+
+  const char* source = cpuid && sysfs ? "cpuid+sysfs" : cpuid ? "cpuid" : "sysfs";
+  static const CpuUtils::CoreType kTypes[] = {
+    CpuUtils::kCoreTypeCore,
+    CpuUtils::kCoreTypeAtom,
+    CpuUtils::kCoreTypeUnknown
+  };
+
+  if (_app->verbose()) {
+    printf("Hybrid (%s):\n", source);
+    for (CpuUtils::CoreType type : kTypes) {
+      String list;
+      for (size_t i = 0; i < cpus.size(); i++)
+        if (types[i] == type)
+          list.appendFormat(list.empty() ? "%u" : " %u", cpus[i]);
+
+      if (!list.empty())
+        printf("  %s: CPUs %s\n", CpuUtils::core_type_as_string(type), list.data());
+    }
+    if (mismatches)
+      printf("  WARNING: CPUID and sysfs disagree on %u CPU(s), using CPUID\n", mismatches);
+    printf("\n");
+  }
+
+  JSONBuilder& json = _app->json();
+  json.beforeRecord()
+      .addKey("hybrid")
+      .openObject()
+        .beforeRecord().addKey("source").addString(source)
+        .beforeRecord().addKey("mismatches").addUInt(mismatches);
+
+  for (CpuUtils::CoreType type : kTypes) {
+    if (std::find(types.begin(), types.end(), type) == types.end())
+      continue;
+
+    json.beforeRecord()
+        .addKey(CpuUtils::core_type_as_string(type))
+        .openArray();
+
+    for (size_t i = 0; i < cpus.size(); i++)
+      if (types[i] == type)
+        json.addUInt(cpus[i]);
+
+    json.closeArray();
+  }
+
+  json.closeObject(true);
+  _app->flush();
 }
 
 void CpuDetect::addEntry(const CpuUtils::CpuidIn& in, const CpuUtils::CpuidOut& out) {
@@ -395,6 +525,40 @@ void CpuDetect::addEntry(const CpuUtils::CpuidIn& in, const CpuUtils::CpuidOut&
       .addKey("ecx").addStringf("0x%08X", out.ecx)
       .addKey("edx").addStringf("0x%08X", out.edx)
       .closeObject();
+  _app->flush();
+}
+
+// Returns 64-bit FNV-1a hash of all CPUID entries, which identifies the CPU model
+// (including microcode visible features). Fields that differ between logical
+// CPUs of the same machine (APIC IDs and topology) are excluded.
+uint64_t CpuDetect::fingerprint() const {
+  uint64_t hash = 0xCBF29CE484222325u;
+
+  for (const CpuUtils::CpuidEntry& entry : _entries) {
+    CpuUtils::CpuidEntry e = entry;
+
+    switch (e.in.eax) {
+      case 0x01u:
+        e.out.ebx &= 0x00FFFFFFu;
+        break;
+
+      case 0x0Bu:
+      case 0x1Fu:
+        e.out.edx = 0;
+        break;
+
+      case 0x8000001Eu:
+        continue;
+    }
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&e);
+    for (size_t i = 0; i < sizeof(e); i++) {
+      hash ^= p[i];
+      hash *= 0x100000001B3u;
+    }
+  }
+
+  return hash;
 }
 
 CpuUtils::CpuidOut CpuDetect::entryOf(uint32_t eax, uint32_t ecx) {
@@ -18,10 +18,14 @@ public:
 
   void _queryCpuData();
   void _queryCpuInfo();
+  void _queryTscInfo();
+  void _queryCoreTypes();
 
   void addEntry(const CpuUtils::CpuidIn& in, const CpuUtils::CpuidOut& out);
   CpuUtils::CpuidOut entryOf(uint32_t eax, uint32_t ecx = 0);
 
+  uint64_t fingerprint() const;
+
   App* _app;
   std::vector<CpuUtils::CpuidEntry> _entries;
 
@@ -6,6 +6,12 @@
   #include <x86intrin.h>
 #endif
 
+#if !defined(_WIN32)
+  #include <time.h>
+#endif
+
+#include <vector>
+
 namespace cult {
 namespace CpuUtils {
 
@@ -31,29 +37,122 @@ void cpuid_query(CpuidOut* result, uint32_t inEax, uint32_t inEcx) {
 #endif
 }
 
-// Heavily inspired in avx-turbo's tsc-support.cpp (https://github.com/travisdowns/avx-turbo).
-uint64_t get_tsc_freq() {
-  CpuidOut out;
-  cpuid_query(&out, 0x0u);
+// Number and length of windows measured by the TSC calibration.
+static constexpr uint32_t kTscCalibrationWindows = 5;
+static constexpr uint64_t kTscCalibrationWindowNs = 10000000;
+
+// Relative spread of calibration windows considered high and medium confidence.
+static constexpr double kTscHighSpread = 1e-4;
+static constexpr double kTscMediumSpread = 1e-3;
+
+static uint64_t monotonic_ns() {
+#if defined(_WIN32)
+  LARGE_INTEGER counter;
+  LARGE_INTEGER freq;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&freq);
+  return uint64_t(double(counter.QuadPart) * 1e9 / double(freq.QuadPart));
+#elif defined(CLOCK_MONOTONIC_RAW)
+  // Not slewed by NTP, which would skew a short calibration.
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+#endif
+}
+
+// Reads the monotonic clock together with TSC, which is read before and after
+// the clock so the pair can be matched by the midpoint.
+static void read_clocks(uint64_t* ns, uint64_t* tsc) {
+  uint64_t t0 = rdtsc();
+  *ns = monotonic_ns();
+  uint64_t t1 = rdtsc();
+  *tsc = t0 + (t1 - t0) / 2;
+}
+
+// Measures TSC against the monotonic clock in several windows and uses the
+// median, the spread of windows decides the confidence.
+static uint64_t calibrate_tsc_freq(TscConfidence* confidence) {
+  std::vector<double> freqs;
+
+  for (uint32_t i = 0; i < kTscCalibrationWindows; i++) {
+    uint64_t startNs, startTsc;
+    uint64_t endNs, endTsc;
+
+    read_clocks(&startNs, &startTsc);
+    do {
+      read_clocks(&endNs, &endTsc);
+    } while (endNs - startNs < kTscCalibrationWindowNs);
 
-  if (out.eax < 0x15u)
+    freqs.push_back(double(endTsc - startTsc) * 1e9 / double(endNs - startNs));
+  }
+
+  std::sort(freqs.begin(), freqs.end());
+  double median = freqs[freqs.size() / 2];
+  double spread = (freqs.back() - freqs.front()) / median;
+
+  if (spread < kTscHighSpread)
+    *confidence = kTscConfidenceHigh;
+  else if (spread < kTscMediumSpread)
+    *confidence = kTscConfidenceMedium;
+  else
+    *confidence = kTscConfidenceLow;
+
+  return uint64_t(median);
+}
+
+// Crystal clock frequency of CPUs that don't report it in CPUID.15h:ECX.
+// (Intel Manual Volume 3 - Determining the Processor Base Frequency, Section 18.18.3)
+static uint64_t known_crystal_freq(uint32_t family, uint32_t model) {
+  if (family != 6)
     return 0;
 
-  // Determine the base frequency by CPUID.15 query.
-  CpuidOut _15;
-  cpuid_query(&_15, 0x15u);
-  if (_15.ecx) {
-    if (_15.eax == 0)
-      return 0;
-    return uint64_t(_15.ecx) * _15.ebx / _15.eax;
+  switch (model) {
+    // Skylake & Kabylake (client).
+    case 0x4E:
+    case 0x5E:
+    case 0x8E:
+    case 0x9E:
+      return 24000000;
+
+    // Goldmont.
+    case 0x5C:
+      return 19200000;
+
+    // Goldmont (Denverton).
+    case 0x5F:
+      return 25000000;
+  }
+
+  return 0;
+}
+
+// Inspired by avx-turbo's tsc-support.cpp (https://github.com/travisdowns/avx-turbo)
+// and the TSC calibration of the Linux kernel.
+void get_tsc_info(TscInfo* info) {
+  info->freq = 0;
+  info->source = kTscSourceNone;
+  info->confidence = kTscConfidenceNone;
+  info->invariant = false;
+
+  CpuidOut out;
+  cpuid_query(&out, 0x0u);
+  uint32_t maxLeaf = out.eax;
+
+  cpuid_query(&out, 0x80000000u);
+  if (out.eax >= 0x80000007u) {
+    cpuid_query(&out, 0x80000007u);
+    info->invariant = (out.edx & (1u << 8)) != 0;
   }
 
-  // Determine the base frequency by CPU family & model ids.
-  // (Intel Manual Volume 3 - Determining the Processor Base Frequency, Section 18.18.3)
   cpuid_query(&out, 0x1u);
+  bool hypervisor = (out.ecx & (1u << 31)) != 0;
 
   uint32_t family = (out.eax >> 8) & 0xF;
-  uint32_t model = (out.eax >> 8) & 0xF;
+  uint32_t model = (out.eax >> 4) & 0xF;
 
   if (family == 15)
     family += (out.eax >> 20) & 0xFF;
@@ -61,11 +160,108 @@ uint64_t get_tsc_freq() {
   if (family == 15 || family == 6)
     model += ((out.eax >> 16) & 0xF) << 4;
 
-  // 24 MHz crystal clock (Skylake or Kabylake).
-  if (family == 6 && (model == 0x4E || model == 0x5E || model == 0x8E || model == 0x9E))
-    return (int64_t)24000000 * _15.ebx / _15.eax;
+  // Crystal clock (ECX) multiplied by the TSC/crystal ratio (EBX/EAX).
+  if (maxLeaf >= 0x15u) {
+    CpuidOut _15;
+    cpuid_query(&_15, 0x15u);
 
-  return 0;
+    if (_15.eax && _15.ebx) {
+      uint64_t crystal = _15.ecx ? uint64_t(_15.ecx) : known_crystal_freq(family, model);
+      if (crystal) {
+        info->freq = crystal * _15.ebx / _15.eax;
+        info->source = kTscSourceCpuid15;
+        info->confidence = kTscConfidenceHigh;
+      }
+    }
+  }
+
+  // Processor base frequency in MHz, which is the nominal TSC frequency.
+  if (!info->freq && maxLeaf >= 0x16u) {
+    CpuidOut _16;
+    cpuid_query(&_16, 0x16u);
+
+    if (_16.eax & 0xFFFFu) {
+      info->freq = uint64_t(_16.eax & 0xFFFFu) * 1000000u;
+      info->source = kTscSourceCpuid16;
+      info->confidence = kTscConfidenceMedium;
+    }
+  }
+
+  // TSC frequency in kHz provided by hypervisors (VMware, KVM, ...).
+  if (!info->freq && hypervisor) {
+    cpuid_query(&out, 0x40000000u);
+    if (out.eax >= 0x40000010u && out.eax < 0x50000000u) {
+      cpuid_query(&out, 0x40000010u);
+      if (out.eax) {
+        info->freq = uint64_t(out.eax) * 1000u;
+        info->source = kTscSourceHypervisor;
+        info->confidence = kTscConfidenceHigh;
+      }
+    }
+  }
+
+  if (!info->freq) {
+    info->freq = calibrate_tsc_freq(&info->confidence);
+    info->source = kTscSourceCalibrated;
+  }
+
+  // A variant TSC only has the frequency of the moment, if any.
+  if (!info->invariant)
+    info->confidence = kTscConfidenceLow;
+}
+
+const char* tsc_source_as_string(TscSource source) {
+  switch (source) {
+    case kTscSourceCpuid15   : return "cpuid-15h";
+    case kTscSourceCpuid16   : return "cpuid-16h";
+    case kTscSourceHypervisor: return "hypervisor";
+    case kTscSourceCalibrated: return "calibrated";
+    default:
+      return "none";
+  }
+}
+
+const char* tsc_confidence_as_string(TscConfidence confidence) {
+  switch (confidence) {
+    case kTscConfidenceLow   : return "low";
+    case kTscConfidenceMedium: return "medium";
+    case kTscConfidenceHigh  : return "high";
+    default:
+      return "none";
+  }
+}
+
+CoreType get_core_type() {
+  CpuidOut out;
+
+  cpuid_query(&out, 0x00u);
+  if (out.eax < 0x1Au)
+    return kCoreTypeUnknown;
+
+  cpuid_query(&out, 0x07u, 0);
+  if (!(out.edx & (1u << 15)))
+    return kCoreTypeUnknown;
+
+  cpuid_query(&out, 0x1Au, 0);
+  switch (out.eax >> 24) {
+    case kCoreTypeAtom: return kCoreTypeAtom;
+    case kCoreTypeCore: return kCoreTypeCore;
+    default:
+      return kCoreTypeUnknown;
+  }
+}
+
+const char* core_type_as_string(CoreType type) {
+  switch (type) {
+    case kCoreTypeAtom: return "e-core";
+    case kCoreTypeCore: return "p-core";
+    default:
+      return "unknown";
+  }
+}
+
+uint64_t rdtsc() {
+  return uint64_t(__rdtsc());
 }
 
 } // CpuUtils namespace
@@ -24,7 +24,55 @@ struct CpuidEntry {
 
 void cpuid_query(CpuidOut* result, uint32_t inEax, uint32_t inEcx = 0);
 
-uint64_t get_tsc_freq();
+// Source of the TSC frequency, in the order they are tried.
+enum TscSource : uint32_t {
+  kTscSourceNone = 0,
+  kTscSourceCpuid15,             // Crystal clock & TSC ratio (CPUID.15h).
+  kTscSourceCpuid16,             // Processor base frequency (CPUID.16h).
+  kTscSourceHypervisor,          // Hypervisor timing leaf (CPUID.40000010h).
+  kTscSourceCalibrated           // Measured against a monotonic clock.
+};
+
+enum TscConfidence : uint32_t {
+  kTscConfidenceNone = 0,
+  kTscConfidenceLow,
+  kTscConfidenceMedium,
+  kTscConfidenceHigh
+};
+
+struct TscInfo {
+  // TSC frequency in Hz, zero if unknown.
+  uint64_t freq;
+  TscSource source;
+  TscConfidence confidence;
+  // Invariant TSC (CPUID.80000007h:EDX[8]) runs at a constant rate regardless of
+  // P/C-states. Time conversions of a variant TSC are not trustworthy.
+  bool invariant;
+};
+
+// Detects the TSC frequency of the CPU the calling thread runs on, falls back to
+// calibration (which takes about 50ms) if CPUID doesn't provide it.
+void get_tsc_info(TscInfo* out);
+
+const char* tsc_source_as_string(TscSource source);
+const char* tsc_confidence_as_string(TscConfidence confidence);
+
+// Core type of hybrid CPUs as reported by CPUID.1Ah:EAX[31:24].
+enum CoreType : uint32_t {
+  kCoreTypeUnknown = 0,
+  kCoreTypeAtom = 0x20,          // Efficient core (E-core).
+  kCoreTypeCore = 0x40           // Performance core (P-core).
+};
+
+// Returns the core type of the CPU the calling thread runs on, which must be
+// pinned. Returns `kCoreTypeUnknown` if the CPU is not hybrid (CPUID.07h:EDX[15])
+// or doesn't report its core type.
+CoreType get_core_type();
+
+const char* core_type_as_string(CoreType type);
+
+// Reads the time-stamp counter (not serialized, only used to time cult itself).
+uint64_t rdtsc();
 
 } // CpuUtils namespace
 } // cult namespace
@@ -0,0 +1,254 @@
+#include "envdetect.h"
+#include "schedutils.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__linux__)
+#include <dirent.h>
+#endif
+
+namespace cult {
+
+static const char kUnknown[] = "unknown";
+
+// Reads the first line of a (sysfs) file without the trailing new line.
+static bool readFirstLine(const char* fileName, std::string& out) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file)
+    return false;
+
+  char line[512];
+  bool ok = fgets(line, sizeof(line), file) != nullptr;
+  fclose(file);
+
+  if (!ok)
+    return false;
+
+  size_t size = strlen(line);
+  while (size && (line[size - 1] == '\n' || line[size - 1] == ' '))
+    size--;
+
+  out.assign(line, size);
+  return true;
+}
+
+// Returns true if `cpu` is in a sysfs CPU list file (like "1-3,5").
+static bool cpuListFileContains(const char* fileName, uint32_t cpu) {
+  std::vector<uint32_t> cpus;
+
+  if (!SchedUtils::readCpuList(fileName, cpus))
+    return false;
+
+  return std::find(cpus.begin(), cpus.end(), cpu) != cpus.end();
+}
+
+EnvDetect::EnvDetect(App* app)
+  : _app(app),
+    _cpu(app->_cpu),
+    _governor(kUnknown),
+    _turbo(kUnknown),
+    _smt(kUnknown),
+    _microcode(kUnknown),
+    _isolated(false),
+    _nohzFull(false),
+    _hypervisor(false) {
+  ::memset(_hypervisorVendor, 0, sizeof(_hypervisorVendor));
+}
+EnvDetect::~EnvDetect() {}
+
+void EnvDetect::run() {
+  _queryHost();
+  _queryHypervisor();
+
+  if (_governor != kUnknown && _governor != "performance")
+    _warn("cpufreq governor of CPU %u is '%s', consider 'performance'", _cpu, _governor.c_str());
+
+  if (_turbo == "enabled")
+    _warn("Turbo is enabled, the core clock may change during the run");
+
+  if (_smt == "on")
+    _warn("SMT is on, a sibling thread may share the core with the benchmark");
+
+  if (_hypervisor)
+    _warn("Running under a hypervisor (%s)", _hypervisorVendor);
+
+  if (!_isolated)
+    _warn("CPU %u is not isolated (isolcpus)", _cpu);
+
+  if (_app->verbose()) {
+    printf("Environment:\n");
+    printf("  CPU: %u (%s)\n", _cpu, _app->_cpuSource);
+    printf("  Governor: %s\n", _governor.c_str());
+    printf("  Turbo: %s\n", _turbo.c_str());
+    printf("  SMT: %s\n", _smt.c_str());
+    printf("  Microcode: %s\n", _microcode.c_str());
+    printf("  Hypervisor: %s\n", _hypervisor ? _hypervisorVendor : "none");
+    printf("  Isolated: %s, nohz_full: %s\n", _isolated ? "yes" : "no", _nohzFull ? "yes" : "no");
+    if (_app->_isolate)
+      printf("  SCHED_FIFO: %s, Memory locked: %s\n", _app->_realtime ? "yes" : "no", _app->_memoryLocked ? "yes" : "no");
+    for (const auto& vulnerability : _vulnerabilities)
+      printf("  Vulnerability %s: %s\n", vulnerability.first.c_str(), vulnerability.second.c_str());
+    for (const std::string& warning : _warnings)
+      printf("  WARNING: %s\n", warning.c_str());
+    printf("\n");
+  }
+
+  JSONBuilder& json = _app->json();
+  json.beforeRecord()
+      .addKey("environment")
+      .openObject()
+        .beforeRecord().addKey("cpu").addUInt(_cpu)
+        .beforeRecord().addKey("cpuSource").addString(_app->_cpuSource)
+        .beforeRecord().addKey("isolation")
+        .openObject()
+          .beforeRecord().addKey("requested").addBool(_app->_isolate)
+          .beforeRecord().addKey("realtime").addBool(_app->_realtime)
+          .beforeRecord().addKey("memoryLocked").addBool(_app->_memoryLocked)
+        .closeObject(true)
+        .beforeRecord().addKey("governor").addString(_governor.c_str())
+        .beforeRecord().addKey("turbo").addString(_turbo.c_str())
+        .beforeRecord().addKey("smt").addString(_smt.c_str())
+        .beforeRecord().addKey("microcode").addString(_microcode.c_str())
+        .beforeRecord().addKey("isolated").addBool(_isolated)
+        .beforeRecord().addKey("nohzFull").addBool(_nohzFull)
+        .beforeRecord().addKey("hypervisor")
+        .openObject()
+          .beforeRecord().addKey("present").addBool(_hypervisor)
+          .beforeRecord().addKey("vendor").addString(_hypervisorVendor)
+          .beforeRecord().addKey("leaves")
+          .openArray();
+
+  for (const CpuUtils::CpuidEntry& entry : _hypervisorLeaves) {
+    json.beforeRecord()
+        .openObject()
+        .addKey("level").addStringf("0x%08X", entry.in.eax)
+        .addKey("eax").addStringf("0x%08X", entry.out.eax)
+        .addKey("ebx").addStringf("0x%08X", entry.out.ebx)
+        .addKey("ecx").addStringf("0x%08X", entry.out.ecx)
+        .addKey("edx").addStringf("0x%08X", entry.out.edx)
+        .closeObject();
+  }
+
+  json.closeArray(true)
+      .closeObject(true)
+      .beforeRecord().addKey("vulnerabilities")
+      .openObject();
+
+  for (const auto& vulnerability : _vulnerabilities)
+    json.beforeRecord().addKey(vulnerability.first.c_str()).addString(vulnerability.second.c_str());
+
+  json.closeObject(true)
+      .beforeRecord().addKey("warnings")
+      .openArray();
+
+  for (const std::string& warning : _warnings)
+    json.beforeRecord().addString(warning.c_str());
+
+  json.closeArray(true)
+      .closeObject(true);
+  _app->flush();
+}
+
+// Reads the state of the host from Linux sysfs and procfs, everything stays
+// unknown on other platforms.
+void EnvDetect::_queryHost() {
+#if defined(__linux__)
+  char path[256];
+  std::string value;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cpufreq/scaling_governor", _cpu);
+  readFirstLine(path, _governor);
+
+  // intel_pstate has its own switch, other drivers use the generic one.
+  if (readFirstLine("/sys/devices/system/cpu/intel_pstate/no_turbo", value))
+    _turbo = value == "0" ? "enabled" : "disabled";
+  else if (readFirstLine("/sys/devices/system/cpu/cpufreq/boost", value))
+    _turbo = value == "1" ? "enabled" : "disabled";
+
+  readFirstLine("/sys/devices/system/cpu/smt/control", _smt);
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/microcode/version", _cpu);
+  if (!readFirstLine(path, _microcode)) {
+    FILE* file = fopen("/proc/cpuinfo", "rb");
+    if (file) {
+      char line[512];
+      while (fgets(line, sizeof(line), file)) {
+        const char* colon = strchr(line, ':');
+        unsigned int revision;
+
+        if (strncmp(line, "microcode", 9) == 0 && colon && sscanf(colon + 1, "%x", &revision) == 1) {
+          char buffer[32];
+          snprintf(buffer, sizeof(buffer), "0x%x", revision);
+          _microcode = buffer;
+          break;
+        }
+      }
+      fclose(file);
+    }
+  }
+
+  _isolated = cpuListFileContains("/sys/devices/system/cpu/isolated", _cpu);
+  _nohzFull = cpuListFileContains("/sys/devices/system/cpu/nohz_full", _cpu);
+
+  const char* vulnerabilitiesDir = "/sys/devices/system/cpu/vulnerabilities";
+  DIR* dir = opendir(vulnerabilitiesDir);
+  if (dir) {
+    while (dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] == '.')
+        continue;
+
+      snprintf(path, sizeof(path), "%s/%s", vulnerabilitiesDir, entry->d_name);
+      if (readFirstLine(path, value))
+        _vulnerabilities.push_back(std::make_pair(std::string(entry->d_name), value));
+    }
+    closedir(dir);
+
+    std::sort(_vulnerabilities.begin(), _vulnerabilities.end());
+  }
+#endif
+}
+
+// Hypervisor CPUID leaves start at 0x40000000, which returns the highest leaf
+// and the vendor signature (like "KVMKVMKVM" or "VMwareVMware"). They are only
+// valid if CPUID.1:ECX[31] (hypervisor present) is set.
+void EnvDetect::_queryHypervisor() {
+  CpuUtils::CpuidOut out;
+  CpuUtils::cpuid_query(&out, 0x1u);
+
+  _hypervisor = (out.ecx & (1u << 31)) != 0;
+  if (!_hypervisor)
+    return;
+
+  CpuUtils::cpuid_query(&out, 0x40000000u);
+  uint32_t* vendor = reinterpret_cast<uint32_t*>(_hypervisorVendor);
+  vendor[0] = out.ebx;
+  vendor[1] = out.ecx;
+  vendor[2] = out.edx;
+
+  uint32_t maxLeaf = std::min<uint32_t>(std::max<uint32_t>(out.eax, 0x40000000u), 0x400000FFu);
+  for (uint32_t leaf = 0x40000000u; leaf <= maxLeaf; leaf++) {
+    CpuUtils::CpuidEntry entry;
+    entry.in.eax = leaf;
+    entry.in.ecx = 0;
+    CpuUtils::cpuid_query(&entry.out, leaf);
+    if (entry.out.isValid())
+      _hypervisorLeaves.push_back(entry);
+  }
+}
+
+void EnvDetect::_warn(const char* fmt, ...) {
+  char buffer[256];
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buffer, sizeof(buffer), fmt, ap);
+  va_end(ap);
+
+  _warnings.push_back(buffer);
+}
+
+} // cult namespace
@@ -0,0 +1,49 @@
+#ifndef _CULT_ENVDETECT_H
+#define _CULT_ENVDETECT_H
+
+#include "app.h"
+#include "cpuutils.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cult {
+
+// Captures conditions of the host that affect results (cpufreq governor, turbo,
+// SMT, microcode, hypervisor, speculative execution mitigations and isolation of
+// the measuring CPU) so results of different hosts can be compared, and warns
+// about those that make results less reliable.
+class EnvDetect {
+public:
+  EnvDetect(App* app);
+  ~EnvDetect();
+
+  void run();
+
+  void _queryHost();
+  void _queryHypervisor();
+  void _warn(const char* fmt, ...);
+
+  App* _app;
+  uint32_t _cpu;
+
+  std::string _governor;
+  std::string _turbo;
+  std::string _smt;
+  std::string _microcode;
+  bool _isolated;
+  bool _nohzFull;
+
+  bool _hypervisor;
+  char _hypervisorVendor[16];
+  std::vector<CpuUtils::CpuidEntry> _hypervisorLeaves;
+
+  // Pairs of a vulnerability name and its mitigation status.
+  std::vector<std::pair<std::string, std::string>> _vulnerabilities;
+  std::vector<std::string> _warnings;
+};
+
+} // cult namespace
+
+#endif // _CULT_ENVDETECT_H
@@ -1,10 +1,63 @@
 #include "instbench.h"
 #include "cpuutils.h"
-
+#include "instfilter.h"
+#include "jsonreader.h"
+#include "listing.h"
+#include "plancache.h"
+#include "schedutils.h"
+#include "workqueue.h"
+
+#include <math.h>
+
+#include <atomic>
+#include <random>
+#include <mutex>
 #include <set>
+#include <thread>
 
 namespace cult {
 
+// Number of specs the compiler thread can run ahead of the measurement thread.
+static constexpr size_t kPipelineDepth = 4;
+
+// Window of cycles a single sample should take, see `InstBench::probeIterations()`.
+static constexpr uint64_t kSampleCyclesMin = 20000;
+static constexpr uint64_t kSampleCyclesMax = 100000;
+static constexpr uint64_t kSampleCyclesTarget = 50000;
+
+static constexpr uint32_t kDefaultIterations = 160;
+static constexpr uint32_t kMaxIterations = 1u << 20;
+static constexpr uint32_t kProbeSamples = 8;
+static constexpr uint32_t kMaxProbeRounds = 6;
+
+// Number of specs measured between two core clock calibrations.
+static constexpr uint32_t kCalibrationInterval = 32;
+
+// Latencies of chains measured by the calibration, in core cycles.
+static constexpr double kCalibrationAddCycles = 1.0;
+static constexpr double kCalibrationImulCycles = 3.0;
+
+// Calibrations of a run differing more than this (or the `imul` check failing by
+// more than this) mean the results are not reliable.
+static constexpr double kMaxCalibrationDrift = 0.02;
+static constexpr double kMaxCalibrationCheckError = 0.05;
+
+// Number of disturbed batches in a row after which a batch is used anyway, so a
+// test makes progress even on a very busy host.
+static constexpr uint32_t kMaxNoisyBatches = 16;
+
+// Rational snapping (`--snap`) - the largest denominator and the largest distance
+// from a fraction (absolute or relative, whichever is larger).
+static constexpr uint32_t kSnapMaxDenominator = 6;
+static constexpr double kSnapHalvesFrom = 8.0;
+static constexpr double kSnapIntegersFrom = 50.0;
+static constexpr double kSnapTolerance = 0.02;
+static constexpr double kSnapRelativeTolerance = 0.01;
+
+// Smallest difference (in cycles) from a baseline considered a deviation, which
+// covers the granularity of rounded results.
+static constexpr double kVerifyMinDelta = 0.1;
+
 class InstSignatureIterator {
 public:
   typedef asmjit::x86::InstDB::InstSignature InstSignature;
@@ -315,6 +368,104 @@ static double roundResult(double x) {
   return n + f;
 }
 
+// Snaps `x` to the closest fraction having a small denominator (a smaller one
+// wins a tie) if it's close enough. Only halves are considered above 8 cycles
+// and only integers above 50 cycles.
+static double snapResult(double x, InstSnap& snap) {
+  snap = InstSnap { 0, 0, 0.0 };
+
+  uint32_t maxDen = x < kSnapHalvesFrom ? kSnapMaxDenominator : x < kSnapIntegersFrom ? 2u : 1u;
+  double tolerance = std::max(kSnapTolerance, x * kSnapRelativeTolerance);
+  double best = tolerance;
+
+  for (uint32_t den = 1; den <= maxDen; den++) {
+    double num = floor(x * double(den) + 0.5);
+    if (num < 1.0)
+      continue;
+
+    double distance = fabs(x - num / double(den));
+    if (distance <= best && (!snap.den || distance < best)) {
+      best = distance;
+      snap.num = uint32_t(num);
+      snap.den = den;
+    }
+  }
+
+  if (!snap.den)
+    return x;
+
+  double snapped = double(snap.num) / double(snap.den);
+  snap.residual = x - snapped;
+  return snapped;
+}
+
+static void emitStats(JSONBuilder& json, const char* key, const SampleStats& stats) {
+  json.addKey(key)
+      .openObject()
+      .addKey("min").addDoublef("%.3f", stats.min)
+      .addKey("median").addDoublef("%.3f", stats.median)
+      .addKey("p90").addDoublef("%.3f", stats.p90)
+      .addKey("p99").addDoublef("%.3f", stats.p99)
+      .addKey("stddev").addDoublef("%.3f", stats.stddev)
+      .addKey("count").addUInt(stats.count)
+      .closeObject();
+}
+
+static void emitSnap(JSONBuilder& json, const char* key, const char* residualKey, const InstSnap& snap) {
+  if (snap.den == 1)
+    json.addKey(key).addStringf("%u", snap.num);
+  else
+    json.addKey(key).addStringf("%u/%u", snap.num, snap.den);
+  json.addKey(residualKey).addDoublef("%.4f", snap.residual);
+}
+
+// Loads weights of specs from a text file (`--weights`). Each line has a weight
+// followed by a glob pattern matching printed specs, like "10 vpadd* ymm, ymm, ymm".
+// Empty lines and lines starting with '#' are ignored.
+static bool loadWeights(const char* fileName, std::vector<InstWeight>& dst) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file) {
+    printf("Couldn't open weights file: %s\n", fileName);
+    return false;
+  }
+
+  char line[512];
+  unsigned lineNumber = 0;
+  bool ok = true;
+
+  while (fgets(line, sizeof(line), file)) {
+    lineNumber++;
+
+    char* p = line;
+    while (*p == ' ' || *p == '\t')
+      p++;
+
+    size_t size = strlen(p);
+    while (size && (p[size - 1] == '\n' || p[size - 1] == '\r' || p[size - 1] == ' ' || p[size - 1] == '\t'))
+      p[--size] = '\0';
+
+    if (!size || *p == '#')
+      continue;
+
+    char* end = nullptr;
+    double weight = strtod(p, &end);
+
+    while (end != p && (*end == ' ' || *end == '\t'))
+      end++;
+
+    if (end == p || !*end) {
+      printf("Invalid weight at %s:%u: %s\n", fileName, lineNumber, p);
+      ok = false;
+      break;
+    }
+
+    dst.push_back(InstWeight { std::string(end), weight });
+  }
+
+  fclose(file);
+  return ok;
+}
+
 // ============================================================================
 // [cult::InstBench]
 // ============================================================================
@@ -324,103 +475,1385 @@ InstBench::InstBench(App* app)
     _instId(0),
     _instSpec(),
     _nUnroll(64),
-    _nParallel(0) {}
+    _nParallel(0),
+    _precision(app->_precision),
+    _budget(nullptr),
+    _streamResults(false),
+    _calibrate(app->_calibrate && _clock == App::kClockTSC),
+    _sinceCalibration(0),
+    _samples(std::max<uint32_t>(app->_batchSize, kProbeSamples)),
+    _batches(0),
+    _noisyBatches(0) {
+  _calibration.reset();
+}
 
 InstBench::~InstBench() {
 }
 
-void InstBench::run() {
+bool InstBench::run() {
+  JSONBuilder& json = _app->json();
+
+  if (_app->verbose())
+    printf("Benchmark (latency & reciprocal throughput):\n");
+
+  if (_app->_weightsFile && !loadWeights(_app->_weightsFile, _weights))
+    return false;
+
+  if (_app->_timeBudget > 0.0) {
+    _timeBudget.start(_app->_timeBudget, _app->_jobs);
+    _budget = &_timeBudget;
+  }
+
+  std::vector<InstResult> results;
+  {
+    Profiler::Scope scope(_app->_profiler, "classify");
+    classifyAll(results);
+  }
+
+  Listing listing;
+  std::vector<double> listingWeights;
+
+  if (_app->_listingFile && !selectFromListing(results, listingWeights, listing))
+    return false;
+
+  if (_app->_verifyFile) {
+    if (!verify(results))
+      return false;
+
+    json.beforeRecord()
+        .addKey("instructions")
+        .openArray();
+
+    for (const InstResult& result : results)
+      emitResult(result);
+  }
+  else {
+    std::vector<size_t> order;
+    if (!openCheckpoint(results, order))
+      return false;
+
+    prioritize(results, order);
+    _timeBudget.schedule(order.size() * std::max<uint32_t>(_app->_repeat, 1));
+
+    json.beforeRecord()
+        .addKey("instructions")
+        .openArray();
+
+    // When streaming, results are written as soon as they are measured (by
+    // `completeResult()`) and those loaded from the checkpoint go first. Results
+    // of repeated runs are only known after the last pass.
+    if (_app->_stream && _app->_repeat <= 1) {
+      std::vector<bool> pending(results.size(), false);
+      for (size_t index : order)
+        pending[index] = true;
+
+      for (size_t i = 0; i < results.size(); i++)
+        if (!pending[i])
+          emitResult(results[i]);
+
+      _app->flush();
+      _streamResults = true;
+    }
+
+    if (_app->_repeat > 1)
+      measureRepeated(results, order);
+    else
+      measureAll(results, order);
+    _checkpoint.close();
+
+    if (!_streamResults) {
+      for (const InstResult& result : results)
+        emitResult(result);
+    }
+    _streamResults = false;
+  }
+
+  if (_app->verbose())
+    printf("\n");
+
+  json.closeArray(true);
+  _app->flush();
+
+  if (_calibrate) {
+    emitCalibration();
+    _app->flush();
+  }
+
+  if (_app->_repeat > 1 && !_app->_verifyFile) {
+    emitRepeatSummary(results);
+    _app->flush();
+  }
+
+  if (_app->_listingFile) {
+    emitListingSummary(results, listingWeights, listing);
+    _app->flush();
+  }
+
+  return true;
+}
+
+void InstBench::emitResult(const InstResult& result) {
+  JSONBuilder& json = _app->json();
+
+  StringTmp<256> sb;
+  formatSpec(sb, result.instId, result.instSpec);
+
+  json.beforeRecord()
+      .openObject()
+      .addKey("inst").addString(sb.data()).alignTo(54);
+
+  if (result.unmeasured) {
+    json.addKey("unmeasured").addBool(true)
+        .closeObject();
+    return;
+  }
+
+  json.addKey("lat").addDoublef("%7.2f", result.lat)
+      .addKey("rcp").addDoublef("%7.2f", result.rcp)
+      .addKey("samples").addUInt(result.samples)
+      .addKey("nIter").addUInt(result.nIter)
+      .addKey("confidence").addDoublef("%.4f", result.confidence);
+
+  if (result.latNs > 0.0 || result.rcpNs > 0.0) {
+    json.addKey("latNs").addDoublef("%.3f", result.latNs)
+        .addKey("rcpNs").addDoublef("%.3f", result.rcpNs);
+  }
+
+  if (result.latSnap.den)
+    emitSnap(json, "latSnap", "latResidual", result.latSnap);
+
+  if (result.rcpSnap.den)
+    emitSnap(json, "rcpSnap", "rcpResidual", result.rcpSnap);
+
+  if (_app->_detectNoise)
+    json.addKey("noise").addDoublef("%.4f", result.noise);
+
+  if (result.passes) {
+    json.addKey("latCv").addDoublef("%.4f", result.latCv)
+        .addKey("rcpCv").addDoublef("%.4f", result.rcpCv)
+        .addKey("unstable").addBool(result.unstable);
+  }
+
+  if (result.latStats.count) {
+    emitStats(json, "latStats", result.latStats);
+    emitStats(json, "rcpStats", result.rcpStats);
+  }
+
+  json.closeObject();
+
+  if (_app->_primaryCoreType) {
+    for (std::unique_ptr<ResultSink>& sink : _app->_sinks)
+      sink->addResult(result, sb.data());
+  }
+}
+
+void InstBench::classifyAll(std::vector<InstResult>& dst) {
+  const char* planFile = _app->_planFile;
+
+  std::vector<InstId> instIds;
+  std::vector<InstSpec> instSpecs;
+
+  if (planFile && PlanCache::load(planFile, _app->_cpuFingerprint, instIds, instSpecs)) {
+    if (_app->verbose())
+      printf("  Loaded %u spec(s) from plan cache '%s'\n", unsigned(instSpecs.size()), planFile);
+  }
+  else {
+    uint32_t instStart = 1;
+    uint32_t instEnd = x86::Inst::_kIdCount;
+
+    // The plan cache always contains all instructions so it can be reused by
+    // runs that select different instructions.
+    if (_app->_singleInstId && !planFile) {
+      instStart = _app->_singleInstId;
+      instEnd = instStart + 1;
+    }
+
+    for (InstId instId = instStart; instId < instEnd; instId++) {
+      std::vector<InstSpec> specs;
+      classify(specs, instId);
+
+      /*
+      if (specs.size() == 0) {
+        asmjit::String name;
+        InstAPI::instIdToString(Environment::kArchHost, instId, name);
+        printf("MISSING SPEC: %s\n", name.data());
+      }
+      */
+
+      for (const InstSpec& instSpec : specs) {
+        instIds.push_back(instId);
+        instSpecs.push_back(instSpec);
+      }
+    }
+
+    if (planFile) {
+      if (PlanCache::save(planFile, _app->_cpuFingerprint, instIds, instSpecs)) {
+        if (_app->verbose())
+          printf("  Saved %u spec(s) to plan cache '%s'\n", unsigned(instSpecs.size()), planFile);
+      }
+      else {
+        printf("Couldn't write plan cache: %s\n", planFile);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < instIds.size(); i++) {
+    InstId instId = instIds[i];
+    InstSpec instSpec = instSpecs[i];
+
+    if (_app->_singleInstId && instId != _app->_singleInstId)
+      continue;
+
+    if (!_app->_filter.empty()) {
+      StringTmp<256> sb;
+      formatSpec(sb, instId, instSpec);
+      if (!_app->_filter.matches(instId, instSpec, sb.data()))
+        continue;
+    }
+
+    dst.push_back(InstResult { instId, instSpec, 0.0, 0.0, 0, 0, 0.0, 0.0, 0.0, {}, {}, {}, {}, 0, 0.0, 0.0, false, 0.0, false });
+  }
+}
+
+// Orders specs at `order` indexes so the most important ones are measured first,
+// which matters when the run is time limited. Specs are ordered by their weight
+// (the first matching pattern of `--weights`, zero if none matches) and then by
+// ISA group, most commonly used groups first.
+void InstBench::prioritize(const std::vector<InstResult>& results, std::vector<size_t>& order) {
+  if (!_budget && _weights.empty())
+    return;
+
+  std::vector<double> weights(results.size(), 0.0);
+  std::vector<uint32_t> groups(results.size(), 0);
+
+  for (size_t index : order) {
+    const InstResult& result = results[index];
+
+    if (!_weights.empty()) {
+      StringTmp<256> sb;
+      formatSpec(sb, result.instId, result.instSpec);
+
+      for (const InstWeight& w : _weights) {
+        if (InstFilter::globMatch(w.pattern.c_str(), sb.data())) {
+          weights[index] = w.weight;
+          break;
+        }
+      }
+    }
+
+    groups[index] = isaGroupOf(result.instId, result.instSpec);
+  }
+
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (weights[a] != weights[b])
+      return weights[a] > weights[b];
+    return groups[a] < groups[b];
+  });
+}
+
+// Returns the ISA group of a spec, lower groups are used more commonly:
+//   0 - General purpose.
+//   1 - SSE.
+//   2 - AVX and AVX2.
+//   3 - AVX-512 (EVEX only instructions and instructions using ZMM or K registers).
+//   4 - MMX.
+uint32_t InstBench::isaGroupOf(InstId instId, InstSpec instSpec) {
+  if (isMMX(instId, instSpec))
+    return 4;
+
+  if (!isVec(instId, instSpec))
+    return 0;
+
+  if (isSSE(instId, instSpec))
+    return 1;
+
+  const x86::InstDB::InstInfo& inst = x86::InstDB::infoById(instId);
+  if (inst.isEvex() && !inst.isVex())
+    return 3;
+
+  for (uint32_t i = 0; i < instSpec.count(); i++)
+    if (instSpec.get(i) == InstSpec::kOpZmm || instSpec.get(i) == InstSpec::kOpKReg)
+      return 3;
+
+  return 2;
+}
+
+// Opens the checkpoint file (if enabled) and fills `order` with indexes of
+// results that still have to be measured. Results loaded from the checkpoint
+// when resuming are filled directly.
+bool InstBench::openCheckpoint(std::vector<InstResult>& results, std::vector<size_t>& order) {
+  const char* fileName = _app->_checkpointFile;
+  std::vector<InstResult> loaded;
+
+  Checkpoint::Key key;
+  key.fingerprint = _app->_cpuFingerprint;
+  key.precision = _app->_precision;
+  key.clock = App::clockAsString(_clock);
+  key.calibrate = _calibrate;
+  key.round = _app->_round;
+  key.snap = _app->_snap;
+
+  if (fileName && !_checkpoint.open(fileName, key, _app->_resume, loaded))
+    return false;
+
+  std::unordered_map<std::string, size_t> loadedMap;
+  for (size_t i = 0; i < loaded.size(); i++)
+    loadedMap[Checkpoint::keyOf(loaded[i])] = i;
+
+  size_t resumed = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    auto it = loadedMap.find(Checkpoint::keyOf(results[i]));
+    if (it != loadedMap.end()) {
+      results[i] = loaded[it->second];
+      resumed++;
+    }
+    else {
+      order.push_back(i);
+    }
+  }
+
+  if (_app->verbose() && fileName && _app->_resume)
+    printf("  Resumed %u result(s) from checkpoint '%s'\n", unsigned(resumed), fileName);
+
+  return true;
+}
+
+void InstBench::measureAll(std::vector<InstResult>& results, const std::vector<size_t>& order) {
+  if (_app->_jobs > 1 || _app->_pipeline) {
+    measureParallel(results, order, _app->_jobs, _app->_pipeline);
+  }
+  else {
+    for (size_t index : order) {
+      measure(results[index]);
+      completeResult(results[index]);
+    }
+
+    if (_calibrate && !order.empty())
+      calibrate();
+  }
+}
+
+// Called once a result was measured, by worker threads under a lock when running
+// in parallel.
+void InstBench::completeResult(const InstResult& result) {
+  printResult(result);
+  if (!result.unmeasured)
+    _checkpoint.add(result);
+
+  if (_streamResults) {
+    emitResult(result);
+    _app->flush();
+  }
+}
+
+// Returns the coefficient of variation (sample standard deviation / mean) of `values`.
+static double coefficientOfVariation(const std::vector<double>& values) {
+  if (values.size() < 2)
+    return 0.0;
+
+  double mean = 0.0;
+  for (double value : values)
+    mean += value;
+  mean /= double(values.size());
+
+  if (mean <= 0.0)
+    return 0.0;
+
+  double m2 = 0.0;
+  for (double value : values)
+    m2 += (value - mean) * (value - mean);
+
+  return sqrt(m2 / double(values.size() - 1)) / mean;
+}
+
+// Measures all specs `--repeat` times. Each pass measures the specs in a shuffled
+// order by a fresh InstBench, thus having a fresh JitRuntime (code at different
+// addresses) and no overheads cached by previous passes. Latency of a spec is
+// taken from the pass having the median latency and reciprocal throughput from
+// the pass having the median reciprocal throughput (each with its nanoseconds,
+// snap and stats), and specs varying between passes more than `--max-cv` are
+// flagged unstable.
+void InstBench::measureRepeated(std::vector<InstResult>& results, const std::vector<size_t>& order) {
+  uint32_t passes = _app->_repeat;
+  std::vector<std::vector<InstResult>> passResults(passes);
+
+  std::mt19937 rng(std::random_device{}());
+  std::vector<size_t> passOrder(order);
+
+  for (uint32_t pass = 0; pass < passes; pass++) {
+    if (_app->verbose())
+      printf("Pass %u of %u:\n", pass + 1, passes);
+
+    std::shuffle(passOrder.begin(), passOrder.end(), rng);
+    passResults[pass] = results;
+
+    InstBench bench(_app);
+    bench.setPrecision(_precision);
+    bench._budget = _budget;
+    bench.measureAll(passResults[pass], passOrder);
+    _calibration.merge(bench._calibration);
+  }
+
+  std::vector<double> lat;
+  std::vector<double> rcp;
+  std::vector<uint32_t> measured;
+
+  for (size_t index : order) {
+    uint32_t samples = 0;
+    lat.clear();
+    rcp.clear();
+    measured.clear();
+
+    // Passes the time budget didn't leave time for don't count.
+    for (uint32_t pass = 0; pass < passes; pass++) {
+      const InstResult& r = passResults[pass][index];
+      if (r.unmeasured)
+        continue;
+
+      lat.push_back(r.lat);
+      rcp.push_back(r.rcp);
+      measured.push_back(pass);
+      samples += r.samples;
+    }
+
+    InstResult& result = results[index];
+    if (measured.empty()) {
+      result.unmeasured = true;
+      continue;
+    }
+
+    uint32_t count = uint32_t(measured.size());
+    std::vector<uint32_t> byLat(count);
+    std::vector<uint32_t> byRcp(count);
+    for (uint32_t i = 0; i < count; i++) {
+      byLat[i] = i;
+      byRcp[i] = i;
+    }
+
+    std::sort(byLat.begin(), byLat.end(), [&](uint32_t a, uint32_t b) { return lat[a] < lat[b]; });
+    std::sort(byRcp.begin(), byRcp.end(), [&](uint32_t a, uint32_t b) { return rcp[a] < rcp[b]; });
+
+    result = passResults[measured[byLat[count / 2]]][index];
+    const InstResult& rcpPass = passResults[measured[byRcp[count / 2]]][index];
+
+    result.rcp = rcpPass.rcp;
+    result.rcpNs = rcpPass.rcpNs;
+    result.rcpSnap = rcpPass.rcpSnap;
+    result.rcpStats = rcpPass.rcpStats;
+
+    // The same as `measureKernels()` does, the latency is never below the throughput.
+    if (result.rcp > result.lat) {
+      result.lat = result.rcp;
+      result.latNs = result.rcpNs;
+      result.latSnap = result.rcpSnap;
+    }
+
+    result.latCv = coefficientOfVariation(lat);
+    result.rcpCv = coefficientOfVariation(rcp);
+    result.samples = samples;
+    result.passes = count;
+    result.unstable = result.latCv > _app->_maxCv || result.rcpCv > _app->_maxCv;
+  }
+}
+
+void InstBench::emitRepeatSummary(const std::vector<InstResult>& results) {
   JSONBuilder& json = _app->json();
 
-  uint64_t tsc_freq = CpuUtils::get_tsc_freq();
+  uint32_t measured = 0;
+  uint32_t unstable = 0;
+  double maxLatCv = 0.0;
+  double maxRcpCv = 0.0;
+
+  for (const InstResult& result : results) {
+    if (!result.passes)
+      continue;
+
+    measured++;
+    unstable += uint32_t(result.unstable);
+    maxLatCv = std::max(maxLatCv, result.latCv);
+    maxRcpCv = std::max(maxRcpCv, result.rcpCv);
+  }
 
   if (_app->verbose()) {
-    if (tsc_freq)
-      printf("Detected TSC frequency: %llu\n", (unsigned long long)tsc_freq);
-    printf("Benchmark (latency & reciprocal throughput):\n");
+    printf("Repeated %u time(s): %u of %u instruction(s) unstable (CV above %.3f)\n", _app->_repeat, unstable, measured, _app->_maxCv);
+    for (const InstResult& result : results) {
+      if (!result.unstable)
+        continue;
+
+      StringTmp<256> sb;
+      formatSpec(sb, result.instId, result.instSpec);
+      printf("  %-40s: LatCV:%.4f RcpCV:%.4f\n", sb.data(), result.latCv, result.rcpCv);
+    }
   }
 
   json.beforeRecord()
-      .addKey("instructions")
-      .openArray();
+      .addKey("repeat")
+      .openObject()
+        .beforeRecord().addKey("passes").addUInt(_app->_repeat)
+        .beforeRecord().addKey("maxCv").addDoublef("%.4f", _app->_maxCv)
+        .beforeRecord().addKey("instructions").addUInt(measured)
+        .beforeRecord().addKey("unstable").addUInt(unstable)
+        .beforeRecord().addKey("maxLatCv").addDoublef("%.4f", maxLatCv)
+        .beforeRecord().addKey("maxRcpCv").addDoublef("%.4f", maxRcpCv)
+      .closeObject(true);
+}
+
+struct BaselineEntry {
+  double lat;
+  double rcp;
+};
+
+// Adds `lat` and `rcp` of the element `node` of an `instructions` array. Entries
+// not measured by the baseline run (`--time-budget`) or missing any of the numbers
+// are skipped, so the instruction is reported as not in the baseline.
+static void addBaselineEntry(const JSONReader& reader, uint32_t node, std::unordered_map<std::string, BaselineEntry>& dst) {
+  uint32_t inst = reader.find(node, "inst");
+  if (inst == JSONReader::kNone || reader.node(inst).type != JSONReader::kTypeString)
+    return;
+
+  uint32_t unmeasured = reader.find(node, "unmeasured");
+  if (unmeasured != JSONReader::kNone && reader.node(unmeasured).type == JSONReader::kTypeBool && reader.node(unmeasured).b)
+    return;
+
+  BaselineEntry entry;
+  entry.lat = reader.numberOf(node, "lat", -1.0);
+  entry.rcp = reader.numberOf(node, "rcp", -1.0);
+  if (entry.lat < 0.0 || entry.rcp < 0.0)
+    return;
+
+  dst[reader.node(inst).str] = entry;
+}
+
+// Returns true if the member `coreType` of `node` is missing (results of a CPU
+// that is not hybrid) or equals `coreType`.
+static bool matchesCoreType(const JSONReader& reader, uint32_t node, const char* coreType) {
+  uint32_t type = reader.find(node, "coreType");
+  return type == JSONReader::kNone || (reader.node(type).type == JSONReader::kTypeString && reader.node(type).str == coreType);
+}
+
+// Loads instructions of a baseline written as NDJSON (`--ndjson`), each line of
+// `content` is a separate document. Returns false if any line is not valid JSON.
+static bool loadBaselineLines(const char* fileName, const std::string& content, const char* coreType, std::unordered_map<std::string, BaselineEntry>& dst) {
+  JSONReader reader;
+  size_t found = 0;
+  size_t start = 0;
+  uint32_t line = 0;
+
+  while (start < content.size()) {
+    size_t end = content.find('\n', start);
+    if (end == std::string::npos)
+      end = content.size();
+    line++;
+
+    if (end > start && !reader.parse(content.data() + start, end - start)) {
+      printf("Couldn't read baseline '%s': %s (line %u)\n", fileName, reader.error(), line);
+      return false;
+    }
+
+    uint32_t root = reader.root();
+    uint32_t inst = reader.find(root, "instructions");
+
+    if (end > start && inst != JSONReader::kNone) {
+      found++;
+      if (matchesCoreType(reader, root, coreType))
+        addBaselineEntry(reader, inst, dst);
+    }
+
+    start = end + 1;
+  }
+
+  if (!found) {
+    printf("Baseline '%s' doesn't contain any 'instructions'\n", fileName);
+    return false;
+  }
+
+  if (dst.empty()) {
+    printf("Baseline '%s' doesn't contain results of %s cores\n", fileName, coreType);
+    return false;
+  }
+
+  return true;
+}
+
+// Loads `lat` and `rcp` of all instructions of a JSON produced by cult, either a
+// single document or NDJSON. Results of a hybrid CPU are taken from the element
+// of `coreTypes` (or lines) measured on cores of `coreType`.
+static bool loadBaseline(const char* fileName, const char* coreType, std::unordered_map<std::string, BaselineEntry>& dst) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file) {
+    printf("Couldn't open baseline '%s'\n", fileName);
+    return false;
+  }
+
+  std::string content;
+  char buf[65536];
+
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) != 0)
+    content.append(buf, n);
+  fclose(file);
+
+  JSONReader reader;
+  if (!reader.parse(content.data(), content.size())) {
+    // NDJSON is not a valid document, but its first line is.
+    JSONReader firstLine;
+    size_t end = content.find('\n');
+    if (end != std::string::npos && firstLine.parse(content.data(), end))
+      return loadBaselineLines(fileName, content, coreType, dst);
+
+    printf("Couldn't read baseline '%s': %s (offset %u)\n", fileName, reader.error(), unsigned(reader.errorOffset()));
+    return false;
+  }
+
+  uint32_t root = reader.root();
+  uint32_t coreTypes = reader.find(root, "coreTypes");
+
+  if (coreTypes != JSONReader::kNone && reader.node(coreTypes).type == JSONReader::kTypeArray) {
+    root = JSONReader::kNone;
+    for (uint32_t i = reader.node(coreTypes).first; i != JSONReader::kNone; i = reader.node(i).next) {
+      if (reader.find(i, "coreType") != JSONReader::kNone && matchesCoreType(reader, i, coreType)) {
+        root = i;
+        break;
+      }
+    }
 
-  uint32_t instStart = 1;
-  uint32_t instEnd = x86::Inst::_kIdCount;
+    if (root == JSONReader::kNone) {
+      printf("Baseline '%s' doesn't contain results of %s cores\n", fileName, coreType);
+      return false;
+    }
+  }
 
-  if (_app->_singleInstId) {
-    instStart = _app->_singleInstId;
-    instEnd = instStart + 1;
+  uint32_t instructions = reader.find(root, "instructions");
+  if (instructions == JSONReader::kNone || reader.node(instructions).type != JSONReader::kTypeArray) {
+    printf("Baseline '%s' doesn't contain 'instructions' array\n", fileName);
+    return false;
   }
 
-  for (InstId instId = instStart; instId < instEnd; instId++) {
-    std::vector<InstSpec> specs;
-    classify(specs, instId);
+  for (uint32_t i = reader.node(instructions).first; i != JSONReader::kNone; i = reader.node(i).next)
+    addBaselineEntry(reader, i, dst);
+
+  return true;
+}
+
+static bool deviatesFrom(double value, double baseline, double threshold) {
+  return fabs(value - baseline) > std::max(baseline * threshold, kVerifyMinDelta);
+}
+
+static bool deviatesFrom(const InstResult& result, const BaselineEntry& entry, double threshold) {
+  return deviatesFrom(result.lat, entry.lat, threshold) ||
+         deviatesFrom(result.rcp, entry.rcp, threshold);
+}
+
+// Verifies the host against a baseline JSON (`--verify-against`). All specs are
+// measured with `--estimate` precision first and only those that deviate from
+// the baseline by more than `--threshold` are measured again with the regular
+// precision, which decides whether they really deviate.
+bool InstBench::verify(std::vector<InstResult>& results) {
+  JSONBuilder& json = _app->json();
+  const char* fileName = _app->_verifyFile;
+  double threshold = _app->_verifyThreshold;
+
+  std::unordered_map<std::string, BaselineEntry> baseline;
+  // Only the core type of the measuring CPU is verified on hybrid CPUs.
+  const char* coreType = CpuUtils::core_type_as_string(_app->coreTypeOf(_app->_cpu));
+  if (!loadBaseline(fileName, coreType, baseline))
+    return false;
+
+  std::vector<std::string> names(results.size());
+  std::vector<size_t> order(results.size());
+
+  for (size_t i = 0; i < results.size(); i++) {
+    StringTmp<256> sb;
+    formatSpec(sb, results[i].instId, results[i].instSpec);
+    names[i].assign(sb.data(), sb.size());
+    order[i] = i;
+  }
+
+  if (_app->verbose())
+    printf("  Verifying %u spec(s) against '%s' with estimate precision\n", unsigned(results.size()), fileName);
+
+  prioritize(results, order);
+  _timeBudget.schedule(order.size());
+
+  setPrecision(Convergence::defaultParams(true));
+  measureAll(results, order);
+
+  std::vector<size_t> escalated;
+  size_t missing = 0;
+  size_t unmeasured = 0;
+
+  for (size_t i = 0; i < results.size(); i++) {
+    auto it = baseline.find(names[i]);
+    if (it == baseline.end())
+      missing++;
+    else if (results[i].unmeasured)
+      unmeasured++;
+    else if (deviatesFrom(results[i], it->second, threshold))
+      escalated.push_back(i);
+  }
+
+  if (!escalated.empty()) {
+    if (_app->verbose())
+      printf("  Re-measuring %u deviating spec(s) with full precision\n", unsigned(escalated.size()));
+
+    _timeBudget.schedule(escalated.size());
+
+    setPrecision(_app->_precision);
+    measureAll(results, escalated);
+
+    // Specs the budget didn't leave time to re-measure keep their estimate.
+    for (size_t index : escalated)
+      results[index].unmeasured = false;
+  }
 
-    /*
-    if (specs.size() == 0) {
-      asmjit::String name;
-      InstAPI::instIdToString(Environment::kArchHost, instId, name);
-      printf("MISSING SPEC: %s\n", name.data());
+  std::vector<size_t> deviations;
+  for (size_t index : escalated)
+    if (deviatesFrom(results[index], baseline[names[index]], threshold))
+      deviations.push_back(index);
+
+  size_t passed = results.size() - missing - unmeasured - deviations.size();
+
+  if (_app->verbose()) {
+    printf("\nVerification against '%s': %u passed (%u after re-measuring), %u deviated, %u not in baseline, %u unmeasured\n",
+      fileName,
+      unsigned(passed),
+      unsigned(escalated.size() - deviations.size()),
+      unsigned(deviations.size()),
+      unsigned(missing),
+      unsigned(unmeasured));
+
+    for (size_t index : deviations) {
+      const InstResult& result = results[index];
+      const BaselineEntry& entry = baseline[names[index]];
+      printf("  %-40s: Lat:%7.2f (was %7.2f) Rcp:%7.2f (was %7.2f)\n",
+        names[index].c_str(), result.lat, entry.lat, result.rcp, entry.rcp);
     }
-    */
+  }
+
+  json.beforeRecord()
+      .addKey("verify")
+      .openObject()
+        .beforeRecord().addKey("baseline").addString(fileName)
+        .beforeRecord().addKey("threshold").addDouble(threshold)
+        .beforeRecord().addKey("passed").addUInt(passed)
+        .beforeRecord().addKey("escalated").addUInt(escalated.size())
+        .beforeRecord().addKey("deviated").addUInt(deviations.size())
+        .beforeRecord().addKey("missing").addUInt(missing)
+        .beforeRecord().addKey("unmeasured").addUInt(unmeasured)
+        .beforeRecord().addKey("deviations")
+        .openArray();
+
+  for (size_t index : deviations) {
+    const InstResult& result = results[index];
+    const BaselineEntry& entry = baseline[names[index]];
+
+    json.beforeRecord()
+        .openObject()
+        .addKey("inst").addString(names[index].c_str()).alignTo(54)
+        .addKey("lat").addDoublef("%7.2f", result.lat)
+        .addKey("baseLat").addDoublef("%7.2f", entry.lat)
+        .addKey("rcp").addDoublef("%7.2f", result.rcp)
+        .addKey("baseRcp").addDoublef("%7.2f", entry.rcp)
+        .closeObject();
+  }
+
+  json.closeArray(true)
+      .closeObject(true);
+  _app->flush();
+
+  return true;
+}
+
+// Keeps only results matching instruction forms of a listing (`--from-listing`)
+// and fills `weights` of the kept results. Results are measured in the order
+// of their weight.
+bool InstBench::selectFromListing(std::vector<InstResult>& results, std::vector<double>& weights, Listing& listing) {
+  const char* fileName = _app->_listingFile;
+
+  if (!listing.load(fileName)) {
+    printf("Couldn't open listing: %s\n", fileName);
+    return false;
+  }
+
+  std::vector<double> all(results.size(), 0.0);
+  listing.match(results, all);
+
+  size_t count = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    if (all[i] <= 0.0)
+      continue;
+
+    StringTmp<256> sb;
+    formatSpec(sb, results[i].instId, results[i].instSpec);
+    _weights.push_back(InstWeight { std::string(sb.data(), sb.size()), all[i] });
+
+    results[count++] = results[i];
+    weights.push_back(all[i]);
+  }
+  results.resize(count);
+
+  if (_app->verbose()) {
+    size_t matchedForms = 0;
+    for (const Listing::Form& form : listing._forms)
+      matchedForms += form.matched;
+
+    printf("  Listing '%s': %u instruction(s), %u unique form(s), %u form(s) matched %u spec(s), %u instruction(s) not recognized\n",
+      fileName,
+      unsigned(listing._lines),
+      unsigned(listing._forms.size()),
+      unsigned(matchedForms),
+      unsigned(count),
+      unsigned(listing._unknownLines));
+  }
+
+  return true;
+}
+
+// Summarizes the measured results weighted by their frequency in the listing.
+// Weighted cycles are the sum of weight * cycles of all matched specs, which is
+// the expected cost of the listing's instruction mix if each instruction was
+// bound by its latency (`lat`) or by its throughput (`rcp`).
+void InstBench::emitListingSummary(const std::vector<InstResult>& results, const std::vector<double>& weights, const Listing& listing) {
+  JSONBuilder& json = _app->json();
+
+  double matchedWeight = 0.0;
+  double cyclesLat = 0.0;
+  double cyclesRcp = 0.0;
 
-    for (size_t i = 0; i < specs.size(); i++) {
-      InstSpec instSpec = specs[i];
-      uint32_t opCount = instSpec.count();
+  // Specs left unmeasured by the time budget don't count as matched.
+  std::vector<size_t> order;
+  for (size_t i = 0; i < results.size(); i++) {
+    if (results[i].unmeasured)
+      continue;
+
+    matchedWeight += weights[i];
+    cyclesLat += weights[i] * results[i].lat;
+    cyclesRcp += weights[i] * results[i].rcp;
+    order.push_back(i);
+  }
+
+  double avgLat = matchedWeight > 0.0 ? cyclesLat / matchedWeight : 0.0;
+  double avgRcp = matchedWeight > 0.0 ? cyclesRcp / matchedWeight : 0.0;
+
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return weights[a] > weights[b];
+  });
+
+  if (_app->verbose()) {
+    printf("\nWeighted cycles of listing '%s' (%.1f%% of the weight matched):\n",
+      _app->_listingFile,
+      listing._totalWeight > 0.0 ? matchedWeight * 100.0 / listing._totalWeight : 0.0);
+    printf("  Total: Lat:%10.2f Rcp:%10.2f\n", cyclesLat, cyclesRcp);
+    printf("  Average per instruction: Lat:%7.2f Rcp:%7.2f\n", avgLat, avgRcp);
+    if (listing._ripLeaLines)
+      printf("  Skipped %u RIP-relative lea instruction(s), no lea form without a base register is benchmarked\n", listing._ripLeaLines);
+
+    for (size_t i = 0; i < std::min<size_t>(order.size(), 20); i++) {
+      const InstResult& result = results[order[i]];
 
       StringTmp<256> sb;
-      if (instId == x86::Inst::kIdCall)
-        sb.append("call+ret");
-      else
-        InstAPI::instIdToString(Arch::kHost, instId, sb);
-
-      for (uint32_t i = 0; i < opCount; i++) {
-        if (i == 0)
-          sb.append(' ');
-        else if (instId == x86::Inst::kIdLea)
-          sb.append(i == 1 ? ", [" : " + ");
-        else
-          sb.append(", ");
+      formatSpec(sb, result.instId, result.instSpec);
+      printf("  %-40s: Weight:%10.2f Lat:%7.2f Rcp:%7.2f\n", sb.data(), weights[order[i]], result.lat, result.rcp);
+    }
+  }
+
+  json.beforeRecord()
+      .addKey("listing")
+      .openObject()
+        .beforeRecord().addKey("file").addString(_app->_listingFile)
+        .beforeRecord().addKey("instructions").addUInt(listing._lines)
+        .beforeRecord().addKey("unknown").addUInt(listing._unknownLines)
+        .beforeRecord().addKey("ripLea").addUInt(listing._ripLeaLines)
+        .beforeRecord().addKey("totalWeight").addDoublef("%.2f", listing._totalWeight)
+        .beforeRecord().addKey("matchedWeight").addDoublef("%.2f", matchedWeight)
+        .beforeRecord().addKey("weightedLat").addDoublef("%.2f", cyclesLat)
+        .beforeRecord().addKey("weightedRcp").addDoublef("%.2f", cyclesRcp)
+        .beforeRecord().addKey("averageLat").addDoublef("%.2f", avgLat)
+        .beforeRecord().addKey("averageRcp").addDoublef("%.2f", avgRcp)
+        .beforeRecord().addKey("specs")
+        .openArray();
+
+  for (size_t index : order) {
+    const InstResult& result = results[index];
+
+    StringTmp<256> sb;
+    formatSpec(sb, result.instId, result.instSpec);
+
+    json.beforeRecord()
+        .openObject()
+        .addKey("inst").addString(sb.data()).alignTo(54)
+        .addKey("weight").addDoublef("%10.2f", weights[index])
+        .addKey("lat").addDoublef("%7.2f", result.lat)
+        .addKey("rcp").addDoublef("%7.2f", result.rcp)
+        .closeObject();
+  }
+
+  json.closeArray(true)
+      .closeObject(true);
+}
 
-        sb.append(instSpecOpAsString(instSpec.get(i)));
-        if (instId == x86::Inst::kIdLea && i == opCount - 1)
-          sb.append(']');
+// Changes the precision of subsequent measurements. Cached overheads were measured
+// with the previous precision so they are dropped.
+void InstBench::setPrecision(const Convergence::Params& precision) {
+  _precision = precision;
+  _overheadCache.clear();
+}
+
+// Marks `result` unmeasured if the time budget is spent, so specs that remain
+// don't pay for compiling, probing and a batch of each test.
+bool InstBench::expired(InstResult& result) const {
+  if (!_budget || !_budget->expired())
+    return false;
+
+  result.unmeasured = true;
+  return true;
+}
+
+void InstBench::measure(InstResult& result) {
+  if (expired(result))
+    return;
+
+  InstKernels kernels;
+  compileKernels(kernels, result.instId, result.instSpec);
+  measureKernels(result, kernels);
+}
+
+// Splits results at `order` indexes over `jobs` worker threads. Each worker is pinned to its own
+// physical core (SMT siblings stay idle so they don't steal execution resources)
+// and has its own InstBench and JitRuntime. Workers pick the next unmeasured spec
+// dynamically, but results are stored by index so the output order stays the same
+// as in a single-core run.
+//
+// When `pipeline` is true each worker also gets a helper thread pinned to another
+// physical core, which compiles kernels of the next specs into a bounded queue so
+// the measuring core does nothing but run them.
+void InstBench::measureParallel(std::vector<InstResult>& results, const std::vector<size_t>& order, uint32_t jobs, bool pipeline) {
+  std::vector<uint32_t> cores;
+  SchedUtils::physicalCores(_app->_measureCpus, cores);
+
+  if (pipeline && cores.size() < 2) {
+    if (_app->verbose())
+      printf("  Pipeline requires at least 2 physical cores, compiling on the measuring core\n");
+    pipeline = false;
+  }
+
+  uint32_t maxJobs = uint32_t(cores.size()) / (pipeline ? 2u : 1u);
+  if (jobs > maxJobs) {
+    if (_app->verbose())
+      printf("  Only %u physical core(s) available, using %u job(s) instead of %u\n", unsigned(cores.size()), maxJobs, jobs);
+    jobs = maxJobs;
+  }
+
+  std::atomic<size_t> next(0);
+  std::mutex resultMutex;
+  std::vector<std::thread> threads;
+
+  for (uint32_t i = 0; i < jobs; i++) {
+    uint32_t measureCpu = cores[i];
+    uint32_t compileCpu = pipeline ? cores[jobs + i] : measureCpu;
+
+    threads.push_back(std::thread([this, pipeline, measureCpu, compileCpu, &results, &order, &next, &resultMutex]() {
+      SchedUtils::setAffinity(measureCpu);
+      if (_app->_isolate)
+        SchedUtils::prefaultStack(SchedUtils::kPrefaultStackSize);
+
+      InstBench worker(_app);
+      worker.setPrecision(_precision);
+      worker._budget = _budget;
+
+      // Calibrates the core clock after the last spec and merges calibrations of
+      // the worker, as each core can run at a different frequency.
+      auto finishCalibration = [this, &worker, &resultMutex]() {
+        if (!worker._calibrate || !worker._sinceCalibration)
+          return;
+
+        worker.calibrate();
+
+        std::lock_guard<std::mutex> guard(resultMutex);
+        _calibration.merge(worker._calibration);
+      };
+
+      if (!pipeline) {
+        for (;;) {
+          size_t i = next.fetch_add(1);
+          if (i >= order.size())
+            break;
+
+          size_t index = order[i];
+          worker.measure(results[index]);
+
+          std::lock_guard<std::mutex> guard(resultMutex);
+          completeResult(results[index]);
+        }
+
+        finishCalibration();
+        return;
       }
 
-      double overheadLat = testInstruction(instId, instSpec, 0, true);
-      double overheadRcp = testInstruction(instId, instSpec, 1, true);
+      // The compiler must outlive the measurement as it owns the executable memory.
+      InstBench compiler(_app);
+      WorkQueue<InstKernels> queue(kPipelineDepth);
+
+      std::thread producer([this, &compiler, &queue, &results, &order, &next, compileCpu]() {
+        SchedUtils::setAffinity(compileCpu);
+
+        for (;;) {
+          size_t i = next.fetch_add(1);
+          if (i >= order.size())
+            break;
+
+          size_t index = order[i];
+
+          // Specs left once the budget is spent are not compiled, the worker
+          // marks them unmeasured.
+          InstKernels kernels;
+          kernels.index = index;
+          kernels.owner = &compiler;
+          kernels.base = nullptr;
+
+          if (!_budget || !_budget->expired())
+            compiler.compileKernels(kernels, results[index].instId, results[index].instSpec);
+          queue.push(kernels);
+        }
 
-      double lat = testInstruction(instId, instSpec, 0, false);
-      double rcp = testInstruction(instId, instSpec, 1, false);
+        queue.close();
+      });
 
-      lat = std::max<double>(lat - overheadLat, 0);
-      rcp = std::max<double>(rcp - overheadRcp, 0);
+      InstKernels kernels;
+      while (queue.pop(kernels)) {
+        worker.measureKernels(results[kernels.index], kernels);
 
-      if (_app->_round) {
-        lat = roundResult(lat);
-        rcp = roundResult(rcp);
+        std::lock_guard<std::mutex> guard(resultMutex);
+        completeResult(results[kernels.index]);
       }
 
-      // Some tests are probably skewed. If this happens the latency is the throughput.
-      if (rcp > lat)
-        lat = rcp;
+      producer.join();
+      finishCalibration();
+    }));
+  }
+
+  for (std::thread& thread : threads)
+    thread.join();
+}
 
-      if (_app->verbose())
-        printf("  %-40s: Lat:%7.2f Rcp:%7.2f\n", sb.data(), lat, rcp);
+void InstBench::compileKernels(InstKernels& kernels, InstId instId, InstSpec instSpec) {
+  FileLogger logger(stdout);
+  SimpleErrorHandler eh;
 
-      json.beforeRecord()
-          .openObject()
-          .addKey("inst").addString(sb.data()).alignTo(54)
-          .addKey("lat").addDoublef("%7.2f", lat)
-          .addKey("rcp").addDoublef("%7.2f", rcp)
-          .closeObject();
+  CodeHolder code;
+  initCode(code, logger, eh);
+
+  x86::Assembler a(&code);
+  Label entries[InstKernels::kCount];
+
+  _instId = instId;
+  _instSpec = instSpec;
+
+  Profiler& profiler = _app->_profiler;
+  String specName;
+  if (profiler.enabled())
+    formatSpec(specName, instId, instSpec);
+
+  {
+    Profiler::Scope scope(profiler, "assemble", specName.data(), Profiler::kPhaseAssemble);
+    for (uint32_t kind = 0; kind < InstKernels::kCount; kind++) {
+      _nParallel = (kind == InstKernels::kOverheadRcp || kind == InstKernels::kRcp) ? 6 : 1;
+      _overheadOnly = kind == InstKernels::kOverheadLat || kind == InstKernels::kOverheadRcp;
+      entries[kind] = emitFunc(a);
     }
   }
 
-  if (_app->verbose())
-    printf("\n");
+  code.detach(&a);
 
-  json.closeArray(true);
+  kernels.owner = this;
+  kernels.base = nullptr;
+  for (uint32_t kind = 0; kind < InstKernels::kCount; kind++)
+    kernels.funcs[kind] = nullptr;
+
+  if (!eh._err) {
+    Profiler::Scope scope(profiler, "runtime.add", specName.data(), Profiler::kPhaseAdd);
+    kernels.base = addCode(code);
+  }
+
+  if (!kernels.base) {
+    String name;
+    InstAPI::instIdToString(Arch::kHost, instId, name);
+    printf("FAILED to compile function for '%s' instruction\n", name.data());
+    return;
+  }
+
+  uint8_t* base = static_cast<uint8_t*>(kernels.base);
+  for (uint32_t kind = 0; kind < InstKernels::kCount; kind++)
+    kernels.funcs[kind] = reinterpret_cast<Func>(base + code.labelOffsetFromBase(entries[kind]));
+
+  // Functions are 64-byte aligned and position independent, so the code between
+  // two entries fully describes the loop shape of an overhead-only kernel.
+  const uint8_t* data = code.textSection()->buffer().data();
+  for (uint32_t kind = InstKernels::kOverheadLat; kind <= InstKernels::kOverheadRcp; kind++) {
+    size_t start = size_t(code.labelOffset(entries[kind]));
+    size_t end = size_t(code.labelOffset(entries[kind + 1]));
+    kernels.overheadCode[kind].assign(reinterpret_cast<const char*>(data + start), end - start);
+  }
+}
+
+void InstBench::measureKernels(InstResult& result, InstKernels& kernels) {
+  if (expired(result)) {
+    if (kernels.base)
+      kernels.owner->releaseCode(kernels.base);
+    return;
+  }
+
+  // Kernels compiled on another core - execute a serializing instruction before
+  // running them as required by the cross-modifying code rules.
+  if (kernels.owner != this) {
+    CpuUtils::CpuidOut out;
+    CpuUtils::cpuid_query(&out, 0);
+  }
+
+  if (_calibrate && _sinceCalibration++ % kCalibrationInterval == 0)
+    calibrate();
+
+  Profiler& profiler = _app->_profiler;
+  String specName;
+  if (profiler.enabled())
+    formatSpec(specName, result.instId, result.instSpec);
+
+  Profiler::Scope scope(profiler, "measure", specName.data(), Profiler::kPhaseMeasure);
+  Convergence conv[InstKernels::kCount];
+
+  // Latency kernels are the slowest, so they decide the iteration count of all.
+  uint32_t nIter = probeIterations(kernels.funcs[InstKernels::kLat]);
+  result.nIter = nIter;
+
+  // When the run is time limited each test gets a fair share of the time left
+  // to this spec when the test starts.
+  TimeBudget::Clock::time_point specDeadline;
+  if (_budget)
+    specDeadline = _budget->nextDeadline();
+
+  SampleHistogram* histograms[InstKernels::kCount] = {};
+  if (_app->_stats) {
+    _latHistogram.reset();
+    _rcpHistogram.reset();
+    histograms[InstKernels::kLat] = &_latHistogram;
+    histograms[InstKernels::kRcp] = &_rcpHistogram;
+  }
+
+  _batches = 0;
+  _noisyBatches = 0;
+
+  double cycles[InstKernels::kCount];
+  for (uint32_t kind = 0; kind < InstKernels::kCount; kind++) {
+    // No test is started once the whole budget is spent, not even its first batch.
+    if (expired(result))
+      break;
+
+    if (_budget)
+      _deadline = TimeBudget::slice(specDeadline, InstKernels::kCount - kind);
+
+    if (kind == InstKernels::kOverheadLat || kind == InstKernels::kOverheadRcp)
+      cycles[kind] = testOverhead(kernels, kind, nIter, conv[kind]);
+    else
+      cycles[kind] = testInstruction(kernels.funcs[kind], nIter, conv[kind], histograms[kind]);
+  }
+
+  // Specs can't be measured once the performance counter failed, and a test
+  // stopped by the deadline without a single sample has no result.
+  if (_counterFailed)
+    result.unmeasured = true;
+
+  for (uint32_t kind = 0; kind < InstKernels::kCount; kind++)
+    if (conv[kind].reason() == Convergence::kStopDeadline && !conv[kind].samples())
+      result.unmeasured = true;
+
+  if (result.unmeasured) {
+    if (kernels.base)
+      kernels.owner->releaseCode(kernels.base);
+    return;
+  }
+
+  double overheadLat = cycles[InstKernels::kOverheadLat];
+  double overheadRcp = cycles[InstKernels::kOverheadRcp];
+  double lat = cycles[InstKernels::kLat];
+  double rcp = cycles[InstKernels::kRcp];
+
+  result.samples = 0;
+  for (uint32_t kind = 0; kind < InstKernels::kCount; kind++)
+    result.samples += conv[kind].samples();
+
+  result.confidence = std::min(conv[InstKernels::kLat].confidence(), conv[InstKernels::kRcp].confidence());
+  result.noise = _batches ? double(_noisyBatches) / double(_batches) : 0.0;
+
+  if (profiler.enabled()) {
+    // The reason reported is the worst of all tests (converged < max-samples < deadline).
+    Convergence::StopReason reason = Convergence::kStopNone;
+    for (uint32_t kind = 0; kind < InstKernels::kCount; kind++)
+      reason = std::max(reason, conv[kind].reason());
+    profiler.addSpecResult(specName.data(), result.samples, Convergence::reasonAsString(reason));
+  }
+
+  if (kernels.base)
+    kernels.owner->releaseCode(kernels.base);
+
+  lat = std::max<double>(lat - overheadLat, 0);
+  rcp = std::max<double>(rcp - overheadRcp, 0);
+
+  // TSC ticks to core cycles, the ratio is 1 if not calibrating.
+  lat *= _calibration.ratio;
+  rcp *= _calibration.ratio;
+
+  // Samples are mapped to cycles the same way as the best one.
+  if (_app->_stats) {
+    double scale = _calibration.ratio / double(nIter * _nUnroll);
+    _latHistogram.stats(result.latStats, scale, -overheadLat * _calibration.ratio);
+    _rcpHistogram.stats(result.rcpStats, scale, -overheadRcp * _calibration.ratio);
+  }
+
+  result.latSnap = InstSnap { 0, 0, 0.0 };
+  result.rcpSnap = InstSnap { 0, 0, 0.0 };
+
+  if (_app->_snap) {
+    lat = snapResult(lat, result.latSnap);
+    rcp = snapResult(rcp, result.rcpSnap);
+  }
+  else if (_app->_round) {
+    lat = roundResult(lat);
+    rcp = roundResult(rcp);
+  }
+
+  // Some tests are probably skewed. If this happens the latency is the throughput.
+  if (rcp > lat) {
+    lat = rcp;
+    result.latSnap = result.rcpSnap;
+  }
+
+  result.lat = lat;
+  result.rcp = rcp;
+
+  // Core cycles to nanoseconds: ratio * TSC frequency is the core frequency.
+  result.latNs = 0.0;
+  result.rcpNs = 0.0;
+  const CpuUtils::TscInfo& tsc = _app->_tsc;
+  if (_calibrate && tsc.freq && tsc.invariant && _calibration.count) {
+    double coreGHz = _calibration.ratio * double(tsc.freq) * 1e-9;
+    result.latNs = lat / coreGHz;
+    result.rcpNs = rcp / coreGHz;
+  }
+}
+
+// Measures the core clock against TSC - the result of the `add` chain gives the
+// ratio used to convert TSC ticks of following specs to core cycles. If the ratio
+// differs from previous calibrations the core clock changed during the run (the
+// results between calibrations are probably skewed) and if the `imul` check fails
+// the chains are not measured reliably (for example in a VM).
+void InstBench::calibrate() {
+  // Calibration is not limited by the time budget.
+  TimeBudget* budget = _budget;
+  _budget = nullptr;
+
+  double add = measureChain(x86::Inst::kIdAdd, InstSpec::pack(InstSpec::kOpGpd, InstSpec::kOpGpd));
+  double imul = measureChain(x86::Inst::kIdImul, InstSpec::pack(InstSpec::kOpGpd, InstSpec::kOpGpd));
+
+  _budget = budget;
+
+  if (!(add > 0.0)) {
+    if (_app->verbose())
+      printf("  Core clock calibration failed, keeping the ratio %.4f\n", _calibration.ratio);
+    return;
+  }
+
+  double ratio = kCalibrationAddCycles / add;
+  double checkError = imul > 0.0 ? fabs(imul * ratio - kCalibrationImulCycles) / kCalibrationImulCycles : 1.0;
+
+  if (_app->verbose()) {
+    if (_calibration.count && fabs(ratio - _calibration.ratio) > kMaxCalibrationDrift * _calibration.ratio)
+      printf("  WARNING: Core clock changed (ratio %.4f -> %.4f), results in between may be skewed\n", _calibration.ratio, ratio);
+
+    if (checkError > kMaxCalibrationCheckError)
+      printf("  WARNING: Calibration check failed (imul measured %.2f cycles instead of %.0f)\n", imul * ratio, kCalibrationImulCycles);
+  }
+
+  _calibration.add(ratio, checkError);
+}
+
+void InstBench::emitCalibration() {
+  JSONBuilder& json = _app->json();
+  const CoreCalibration& c = _calibration;
+
+  bool passed = c.count && c.drift() <= kMaxCalibrationDrift && c.maxCheckError <= kMaxCalibrationCheckError;
+
+  if (_app->verbose()) {
+    printf("Core clock calibration: %u calibration(s), core/TSC ratio %.4f..%.4f, %s\n",
+      c.count,
+      c.minRatio,
+      c.maxRatio,
+      passed ? "passed" : "FAILED (results may be skewed)");
+  }
+
+  json.beforeRecord()
+      .addKey("calibration")
+      .openObject()
+        .beforeRecord().addKey("count").addUInt(c.count)
+        .beforeRecord().addKey("minRatio").addDoublef("%.4f", c.minRatio)
+        .beforeRecord().addKey("maxRatio").addDoublef("%.4f", c.maxRatio)
+        .beforeRecord().addKey("drift").addDoublef("%.4f", c.drift())
+        .beforeRecord().addKey("checkError").addDoublef("%.4f", c.maxCheckError)
+        .beforeRecord().addKey("passed").addBool(passed)
+      .closeObject(true);
+}
+
+// Returns the latency of a spec in TSC ticks (or -1 if it cannot be compiled).
+double InstBench::measureChain(InstId instId, InstSpec instSpec) {
+  InstKernels kernels;
+  compileKernels(kernels, instId, instSpec);
+  if (!kernels.base)
+    return -1.0;
+
+  Convergence overheadConv;
+  Convergence conv;
+
+  uint32_t nIter = probeIterations(kernels.funcs[InstKernels::kLat]);
+  double overhead = testOverhead(kernels, InstKernels::kOverheadLat, nIter, overheadConv);
+  double lat = testInstruction(kernels.funcs[InstKernels::kLat], nIter, conv);
+
+  releaseCode(kernels.base);
+  return std::max<double>(lat - overhead, 0.0);
+}
+
+void InstBench::printResult(const InstResult& result) {
+  if (!_app->verbose())
+    return;
+
+  StringTmp<256> sb;
+  formatSpec(sb, result.instId, result.instSpec);
+  if (result.unmeasured)
+    printf("  %-40s: Unmeasured (%s)\n", sb.data(), _counterFailed ? "performance counter failed" : "time budget spent");
+  else if (_budget)
+    printf("  %-40s: Lat:%7.2f Rcp:%7.2f Samples:%u Confidence:%.3f\n", sb.data(), result.lat, result.rcp, result.samples, result.confidence);
+  else
+    printf("  %-40s: Lat:%7.2f Rcp:%7.2f Samples:%u\n", sb.data(), result.lat, result.rcp, result.samples);
+}
+
+void InstBench::formatSpec(String& sb, InstId instId, InstSpec instSpec) {
+  uint32_t opCount = instSpec.count();
+
+  if (instId == x86::Inst::kIdCall)
+    sb.append("call+ret");
+  else
+    InstAPI::instIdToString(Arch::kHost, instId, sb);
+
+  for (uint32_t i = 0; i < opCount; i++) {
+    if (i == 0)
+      sb.append(' ');
+    else if (instId == x86::Inst::kIdLea)
+      sb.append(i == 1 ? ", [" : " + ");
+    else
+      sb.append(", ");
+
+    sb.append(instSpecOpAsString(instSpec.get(i)));
+    if (instId == x86::Inst::kIdLea && i == opCount - 1)
+      sb.append(']');
+  }
 }
 
 void InstBench::classify(std::vector<InstSpec>& dst, InstId instId) {
@@ -675,70 +2108,122 @@ bool InstBench::_canRun(const BaseInst& inst, const Operand_* operands, uint32_t
   return true;
 }
 
-uint32_t InstBench::numIterByInstId(InstId instId) {
-  switch (instId) {
-    // Return low number for instructions that are really slow.
-    case x86::Inst::kIdCpuid:
-    case x86::Inst::kIdRdrand:
-    case x86::Inst::kIdRdseed:
-      return 4;
+// Finds the number of iterations for which a single sample of `func` takes
+// between `kSampleCyclesMin` and `kSampleCyclesMax` cycles. Samples that are
+// too short are dominated by the serialization around RDTSC, and samples that
+// are too long are likely to be interrupted. The result is rounded down to a
+// power of 2 so specs of similar speed share the same loop overhead.
+uint32_t InstBench::probeIterations(Func func) {
+  if (!func)
+    return kDefaultIterations;
+
+  uint32_t nIter = 1;
+  for (uint32_t round = 0; round < kMaxProbeRounds; round++) {
+    uint64_t cycles = ~uint64_t(0);
+    if (!runFunc(func, nIter, _samples.data(), kProbeSamples))
+      break;
 
-    default:
-      return 160;
+    for (uint32_t i = 0; i < kProbeSamples; i++)
+      cycles = std::min(cycles, _samples[i]);
+
+    if (cycles >= kSampleCyclesMin && cycles <= kSampleCyclesMax)
+      break;
+
+    double scaled = double(nIter) * double(kSampleCyclesTarget) / double(std::max<uint64_t>(cycles, 1));
+    scaled = std::min(std::max(scaled, 1.0), double(kMaxIterations));
+
+    uint32_t next = 1u << (31 - Support::clz(uint32_t(scaled)));
+    if (next == nIter)
+      break;
+    nIter = next;
   }
-}
 
-double InstBench::testInstruction(InstId instId, InstSpec instSpec, uint32_t parallel, bool overheadOnly) {
-  _instId = instId;
-  _instSpec = instSpec;
-  _nParallel = parallel ? 6 : 1;
-  _overheadOnly = overheadOnly;
+  return nIter;
+}
 
-  Func func = compileFunc();
+double InstBench::testOverhead(const InstKernels& kernels, uint32_t kind, uint32_t nIter, Convergence& conv) {
+  Func func = kernels.funcs[kind];
   if (!func) {
-    String name;
-    InstAPI::instIdToString(Arch::kHost, instId, name);
-    printf("FAILED to compile function for '%s' instruction\n", name.data());
+    conv.reset(_precision);
     return -1.0;
   }
 
-  uint32_t nIter = numIterByInstId(_instId);
+  std::string key(kernels.overheadCode[kind]);
+  key.append(reinterpret_cast<const char*>(&nIter), sizeof(nIter));
+
+  auto it = _overheadCache.find(key);
+  if (it != _overheadCache.end()) {
+    conv.reset(_precision);
+    return it->second;
+  }
+
+  double overhead = testInstruction(func, nIter, conv);
+  if (overhead >= 0.0)
+    _overheadCache[key] = overhead;
+  return overhead;
+}
+
+double InstBench::testInstruction(Func func, uint32_t nIter, Convergence& conv, SampleHistogram* histogram) {
+  conv.reset(_precision);
+  if (!func)
+    return -1.0;
+
+  // Each call takes a batch of samples, which saves the call overhead and the
+  // register spills of the function prolog/epilog per sample.
+  uint32_t batchSize = _app->_batchSize;
+  bool detectNoise = _app->_detectNoise;
+  uint32_t noisyInRow = 0;
 
-  // Consider a significant improvement 0.08 cycles per instruction (0.2 cycles in fast mode).
-  uint32_t kSignificantImprovement = uint32_t(double(nIter) * (_app->_estimate ? 0.2 : 0.08));
+  if (detectNoise) {
+    if (!_noise.isInitialized())
+      _noise.init();
+    _noise.beginTest();
+  }
 
-  // If we called the function N times without a significant improvement we terminate the test.
-  uint32_t kMaximumImprovementTries = _app->_estimate ? 1000 : 50000;
+  for (;;) {
+    if (detectNoise)
+      _noise.beginBatch();
 
-  uint32_t kMaxIterationCount = 1000000;
+    if (!runFunc(func, nIter, _samples.data(), batchSize))
+      return -1.0;
+    _batches++;
 
-  uint64_t best;
-  func(nIter, &best);
+    // A disturbed batch is discarded and taken again.
+    bool discard = false;
+    if (detectNoise && _noise.endBatch() != NoiseMonitor::kSourceNone) {
+      discard = ++noisyInRow < kMaxNoisyBatches;
+      _noisyBatches += uint32_t(discard);
+    }
 
-  uint64_t previousBest = best;
-  uint32_t improvementTries = 0;
+    if (!discard) {
+      noisyInRow = 0;
 
-  for (uint32_t i = 0; i < kMaxIterationCount; i++) {
-    uint64_t n;
-    func(nIter, &n);
+      uint32_t i = 0;
+      while (i < batchSize) {
+        if (histogram)
+          histogram->add(_samples[i]);
 
-    best = std::min(best, n);
-    if (n < previousBest) {
-      if (previousBest - n >= kSignificantImprovement) {
-        previousBest = n;
-        improvementTries = 0;
+        if (conv.add(_samples[i]))
+          break;
+        i++;
       }
-    }
-    else {
-      improvementTries++;
+
+      if (i < batchSize)
+        break;
     }
 
-    if (improvementTries >= kMaximumImprovementTries)
+    if (_budget && TimeBudget::Clock::now() >= _deadline) {
+      conv.stopAtDeadline();
       break;
+    }
   }
 
-  releaseFunc(func);
-  return double(best) / (double(nIter * _nUnroll));
+  // The deadline passed before any batch was accepted (all were discarded as
+  // disturbed), so there is no minimum.
+  if (!conv.samples())
+    return -1.0;
+
+  return double(conv.best()) / (double(nIter * _nUnroll));
 }
 
 void InstBench::beforeBody(x86::Assembler& a) {
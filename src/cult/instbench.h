@@ -1,12 +1,21 @@
 #ifndef _CULT_INSTBENCH_H
 #define _CULT_INSTBENCH_H
 
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "basebench.h"
+#include "checkpoint.h"
+#include "convergence.h"
+#include "noisemonitor.h"
+#include "samplestats.h"
+#include "timebudget.h"
 
 namespace cult {
 
+class Listing;
+
 // ============================================================================
 // [cult::InstSpec]
 // ============================================================================
@@ -87,19 +96,183 @@ struct InstSpec {
   uint64_t value;
 };
 
+// ============================================================================
+// [cult::InstResult]
+// ============================================================================
+
+// Result snapped to a simple fraction like 1/2, 1/3 or 2/3 (`--snap`), `den` is
+// zero if the result is not close to any of them.
+struct InstSnap {
+  uint32_t num;
+  uint32_t den;
+  // Measured value minus the snapped value.
+  double residual;
+};
+
+struct InstResult {
+  InstId instId;
+  InstSpec instSpec;
+  double lat;
+  double rcp;
+  // Number of samples taken by all kernels of this spec.
+  uint32_t samples;
+  // Number of loop iterations of a single sample.
+  uint32_t nIter;
+  // Confidence reached by the less converged of latency and throughput tests,
+  // lower than requested if the test was stopped by `--time-budget`.
+  double confidence;
+  // Latency and reciprocal throughput in nanoseconds, zero if unknown (only known
+  // if the core clock was calibrated and the TSC frequency is known).
+  double latNs;
+  double rcpNs;
+  // Distribution of latency and reciprocal throughput samples (`--stats`), not
+  // stored in checkpoints.
+  SampleStats latStats;
+  SampleStats rcpStats;
+  InstSnap latSnap;
+  InstSnap rcpSnap;
+  // Number of passes measured by `--repeat` (0 if not repeated) and coefficients
+  // of variation of latency and reciprocal throughput between passes.
+  uint32_t passes;
+  double latCv;
+  double rcpCv;
+  // True if any of the coefficients of variation exceeds `--max-cv`.
+  bool unstable;
+  // Fraction of batches discarded as disturbed (`--detect-noise`).
+  double noise;
+  // True if the spec was not measured because `--time-budget` was spent or the
+  // performance counter couldn't be used.
+  bool unmeasured;
+};
+
+// ============================================================================
+// [cult::CoreCalibration]
+// ============================================================================
+
+// Core clock calibration of a run measured by TSC. Each calibration measures a
+// chain of dependent `add` instructions (1 cycle each), which gives the number
+// of core cycles per TSC tick (ratio), and checks it by a chain of dependent
+// `imul` instructions (3 cycles each).
+struct CoreCalibration {
+  inline void reset() {
+    count = 0;
+    ratio = 1.0;
+    minRatio = 0.0;
+    maxRatio = 0.0;
+    maxCheckError = 0.0;
+  }
+
+  inline void add(double r, double checkError) {
+    minRatio = count ? std::min(minRatio, r) : r;
+    maxRatio = count ? std::max(maxRatio, r) : r;
+    maxCheckError = std::max(maxCheckError, checkError);
+    ratio = r;
+    count++;
+  }
+
+  inline void merge(const CoreCalibration& other) {
+    if (!other.count)
+      return;
+
+    minRatio = count ? std::min(minRatio, other.minRatio) : other.minRatio;
+    maxRatio = count ? std::max(maxRatio, other.maxRatio) : other.maxRatio;
+    maxCheckError = std::max(maxCheckError, other.maxCheckError);
+    ratio = other.ratio;
+    count += other.count;
+  }
+
+  // Relative difference of the smallest and the largest ratio of the run.
+  inline double drift() const { return count ? (maxRatio - minRatio) / minRatio : 0.0; }
+
+  uint32_t count;
+  // Ratio of the last calibration.
+  double ratio;
+  double minRatio;
+  double maxRatio;
+  // The largest relative error of the `imul` check.
+  double maxCheckError;
+};
+
+// ============================================================================
+// [cult::InstWeight]
+// ============================================================================
+
+// Weight of specs matching a glob `pattern` (see `--weights`), specs having a
+// higher weight are measured first.
+struct InstWeight {
+  std::string pattern;
+  double weight;
+};
+
+// ============================================================================
+// [cult::InstKernels]
+// ============================================================================
+
+// Benchmark kernels compiled for a single spec. All kernels share a single code
+// buffer starting at `base`, each having its own entry point. Kernels can be
+// compiled by a different InstBench (see `--pipeline`) than the one that runs
+// them, thus the `owner` is used to release them.
+struct InstKernels {
+  enum Kind : uint32_t {
+    kOverheadLat = 0,
+    kOverheadRcp,
+    kLat,
+    kRcp,
+    kCount
+  };
+
+  size_t index;
+  BaseBench* owner;
+  void* base;
+  BaseBench::Func funcs[kCount];
+
+  // Machine code of overhead-only kernels, used as a key of the overhead cache.
+  std::string overheadCode[2];
+};
+
 // ============================================================================
 // [cult::InstBench]
 // ============================================================================
 
 class InstBench : public BaseBench {
 public:
-  typedef void (*Func)(uint32_t nIter, uint64_t* out);
+  typedef void (*Func)(uint32_t nIter, uint64_t* out, uint32_t nSamples, uint32_t counter);
 
   InstBench(App* app);
   virtual ~InstBench();
 
   void classify(std::vector<InstSpec>& dst, InstId instId);
-  double testInstruction(InstId instId, InstSpec instSpec, uint32_t parallel, bool overheadOnly);
+  void classifyAll(std::vector<InstResult>& dst);
+
+  bool openCheckpoint(std::vector<InstResult>& results, std::vector<size_t>& order);
+  void measureAll(std::vector<InstResult>& results, const std::vector<size_t>& order);
+  void measureRepeated(std::vector<InstResult>& results, const std::vector<size_t>& order);
+  void emitRepeatSummary(const std::vector<InstResult>& results);
+  void completeResult(const InstResult& result);
+  void emitResult(const InstResult& result);
+  bool verify(std::vector<InstResult>& results);
+  bool selectFromListing(std::vector<InstResult>& results, std::vector<double>& weights, Listing& listing);
+  void emitListingSummary(const std::vector<InstResult>& results, const std::vector<double>& weights, const Listing& listing);
+  void prioritize(const std::vector<InstResult>& results, std::vector<size_t>& order);
+  uint32_t isaGroupOf(InstId instId, InstSpec instSpec);
+  void setPrecision(const Convergence::Params& precision);
+
+  bool expired(InstResult& result) const;
+  void measure(InstResult& result);
+  void measureParallel(std::vector<InstResult>& results, const std::vector<size_t>& order, uint32_t jobs, bool pipeline);
+  void compileKernels(InstKernels& kernels, InstId instId, InstSpec instSpec);
+  void measureKernels(InstResult& result, InstKernels& kernels);
+  void printResult(const InstResult& result);
+
+  void calibrate();
+  void emitCalibration();
+  double measureChain(InstId instId, InstSpec instSpec);
+
+  static void formatSpec(String& sb, InstId instId, InstSpec instSpec);
+
+  uint32_t probeIterations(Func func);
+  double testOverhead(const InstKernels& kernels, uint32_t kind, uint32_t nIter, Convergence& conv);
+  double testInstruction(Func func, uint32_t nIter, Convergence& conv, SampleHistogram* histogram = nullptr);
 
   inline bool is64Bit() const {
     return Environment::is64Bit(Arch::kHost);
@@ -107,8 +280,6 @@ public:
 
   bool isImplicit(InstId instId);
 
-  uint32_t numIterByInstId(InstId instId);
-
   inline bool isMMX(InstId instId, InstSpec spec) {
     return spec.get(0) == InstSpec::kOpMm || spec.get(1) == InstSpec::kOpMm;
   }
@@ -140,7 +311,7 @@ public:
 
   bool _canRun(const BaseInst& inst, const Operand_* operands, uint32_t count) const;
 
-  void run() override;
+  bool run() override;
   void beforeBody(x86::Assembler& a) override;
   void compileBody(x86::Assembler& a, x86::Gp rCnt) override;
   void afterBody(x86::Assembler& a) override;
@@ -150,6 +321,49 @@ public:
   uint32_t _nUnroll;
   uint32_t _nParallel;
   bool _overheadOnly;
+
+  // Precision of measurements, `_app->_precision` unless changed by `verify()`.
+  Convergence::Params _precision;
+
+  // Weights of specs used by `prioritize()`.
+  std::vector<InstWeight> _weights;
+
+  // Time budget of the whole run (`--time-budget`), shared with workers through
+  // `_budget`, which is null if the run is not time limited.
+  TimeBudget _timeBudget;
+  TimeBudget* _budget;
+  // Deadline of the currently running test, only used if `_budget` is set.
+  TimeBudget::Clock::time_point _deadline;
+
+  // True while measured results are written to the output as they complete.
+  bool _streamResults;
+
+  // True if results are converted from TSC ticks to core cycles (see `calibrate()`),
+  // which is done every `kCalibrationInterval` specs by each measuring InstBench.
+  bool _calibrate;
+  uint32_t _sinceCalibration;
+  CoreCalibration _calibration;
+
+  // Overhead measurements keyed by machine code of the kernel and its iteration
+  // count. Overhead-only kernels of most specs are identical so they are only
+  // measured once per InstBench.
+  std::unordered_map<std::string, double> _overheadCache;
+
+  // Buffer that receives samples of a single call of a benchmark function.
+  std::vector<uint64_t> _samples;
+
+  // Detects disturbed batches (`--detect-noise`), initialized by the first test
+  // as it has to be initialized by the measuring thread. Batches of the current
+  // spec, all and disturbed, give its noise score.
+  NoiseMonitor _noise;
+  uint32_t _batches;
+  uint32_t _noisyBatches;
+
+  // Samples of latency and reciprocal throughput tests (`--stats`).
+  SampleHistogram _latHistogram;
+  SampleHistogram _rcpHistogram;
+
+  Checkpoint _checkpoint;
 };
 
 } // cult namespace
@@ -0,0 +1,272 @@
+#include "instfilter.h"
+#include "instbench.h"
+
+#include <ctype.h>
+#include <string.h>
+
+namespace cult {
+
+// Names of register kinds accepted by `--width`, matched against operands of a spec.
+static bool opMatchesWidth(uint32_t op, const std::string& width) {
+  if (width == "r8")
+    return op == InstSpec::kOpGpb || (op >= InstSpec::kOpAl && op <= InstSpec::kOpBl);
+  if (width == "r16")
+    return op == InstSpec::kOpGpw || (op >= InstSpec::kOpAx && op <= InstSpec::kOpBx);
+  if (width == "r32")
+    return op == InstSpec::kOpGpd || (op >= InstSpec::kOpEax && op <= InstSpec::kOpEbx);
+  if (width == "r64")
+    return op == InstSpec::kOpGpq || (op >= InstSpec::kOpRax && op <= InstSpec::kOpRbx);
+  if (width == "mm")
+    return op == InstSpec::kOpMm;
+  if (width == "xmm")
+    return op == InstSpec::kOpXmm || op == InstSpec::kOpXmm0;
+  if (width == "ymm")
+    return op == InstSpec::kOpYmm;
+  if (width == "zmm")
+    return op == InstSpec::kOpZmm;
+  if (width == "k")
+    return op == InstSpec::kOpKReg;
+  return false;
+}
+
+static bool isValidWidth(const std::string& width) {
+  static const char* const names[] = { "r8", "r16", "r32", "r64", "mm", "xmm", "ymm", "zmm", "k" };
+  for (const char* name : names)
+    if (width == name)
+      return true;
+  return false;
+}
+
+static bool opMatchesKind(uint32_t op, const std::string& kind) {
+  if (kind == "rel")
+    return op == InstSpec::kOpRel;
+  if (kind == "imm")
+    return op >= InstSpec::kOpImm8 && op <= InstSpec::kOpImm64;
+  if (kind == "mem")
+    return op >= InstSpec::kOpMem8 && op <= InstSpec::kOpMem512;
+  if (kind == "reg")
+    return op >= InstSpec::kOpGpb && op <= InstSpec::kOpKReg;
+  return false;
+}
+
+static bool isValidKind(const std::string& kind) {
+  return kind == "rel" || kind == "imm" || kind == "mem" || kind == "reg";
+}
+
+// Creates operands having the same types as the operands of `instSpec`, which
+// is enough to query CPU features required by the instruction.
+static uint32_t specToOperands(const InstSpec& instSpec, Operand* operands) {
+  uint32_t opCount = instSpec.count();
+
+  for (uint32_t i = 0; i < opCount; i++) {
+    uint32_t op = instSpec.get(i);
+    x86::Reg reg;
+
+    switch (op) {
+      case InstSpec::kOpGpb : reg._initReg(OperandSignature{x86::GpbLo::kSignature}, 1); break;
+      case InstSpec::kOpGpw : reg._initReg(OperandSignature{x86::Gpw::kSignature}, 1); break;
+      case InstSpec::kOpGpd : reg._initReg(OperandSignature{x86::Gpd::kSignature}, 1); break;
+      case InstSpec::kOpGpq : reg._initReg(OperandSignature{x86::Gpq::kSignature}, 1); break;
+      case InstSpec::kOpMm  : reg._initReg(OperandSignature{x86::Mm::kSignature}, 1); break;
+      case InstSpec::kOpXmm : reg._initReg(OperandSignature{x86::Xmm::kSignature}, 1); break;
+      case InstSpec::kOpXmm0: reg._initReg(OperandSignature{x86::Xmm::kSignature}, 0); break;
+      case InstSpec::kOpYmm : reg._initReg(OperandSignature{x86::Ymm::kSignature}, 1); break;
+      case InstSpec::kOpZmm : reg._initReg(OperandSignature{x86::Zmm::kSignature}, 1); break;
+      case InstSpec::kOpKReg: reg._initReg(OperandSignature{x86::KReg::kSignature}, 1); break;
+
+      case InstSpec::kOpMem8  : operands[i] = x86::byte_ptr(0); continue;
+      case InstSpec::kOpMem16 : operands[i] = x86::word_ptr(0); continue;
+      case InstSpec::kOpMem32 : operands[i] = x86::dword_ptr(0); continue;
+      case InstSpec::kOpMem64 : operands[i] = x86::qword_ptr(0); continue;
+      case InstSpec::kOpMem128: operands[i] = x86::xmmword_ptr(0); continue;
+      case InstSpec::kOpMem256: operands[i] = x86::ymmword_ptr(0); continue;
+      case InstSpec::kOpMem512: operands[i] = x86::zmmword_ptr(0); continue;
+
+      default:
+        if (op >= InstSpec::kOpAl && op <= InstSpec::kOpBl)
+          reg._initReg(OperandSignature{x86::GpbLo::kSignature}, op - InstSpec::kOpAl);
+        else if (op >= InstSpec::kOpAx && op <= InstSpec::kOpBx)
+          reg._initReg(OperandSignature{x86::Gpw::kSignature}, op - InstSpec::kOpAx);
+        else if (op >= InstSpec::kOpEax && op <= InstSpec::kOpEbx)
+          reg._initReg(OperandSignature{x86::Gpd::kSignature}, op - InstSpec::kOpEax);
+        else if (op >= InstSpec::kOpRax && op <= InstSpec::kOpRbx)
+          reg._initReg(OperandSignature{x86::Gpq::kSignature}, op - InstSpec::kOpRax);
+        else {
+          // Immediates and relative targets (encoded as immediates as well).
+          operands[i] = Imm(1);
+          continue;
+        }
+        break;
+    }
+
+    operands[i] = reg;
+  }
+
+  return opCount;
+}
+
+static void splitList(const char* value, std::vector<std::string>& dst) {
+  const char* p = value;
+  for (;;) {
+    const char* end = strchr(p, ',');
+    size_t size = end ? size_t(end - p) : strlen(p);
+
+    if (size)
+      dst.push_back(std::string(p, size));
+
+    if (!end)
+      break;
+    p = end + 1;
+  }
+}
+
+bool InstFilter::addTerm(Kind kind, const char* value, std::string& error) {
+  Term term;
+  term.kind = kind;
+  term.negate = value[0] == '!';
+
+  if (term.negate)
+    value++;
+
+  if (kind == kKindRegex) {
+    try {
+      term.regex = std::regex(value, std::regex::ECMAScript | std::regex::optimize);
+    }
+    catch (const std::regex_error& e) {
+      error = std::string("Invalid regular expression '") + value + "': " + e.what();
+      return false;
+    }
+  }
+  else {
+    splitList(value, term.patterns);
+    if (term.patterns.empty()) {
+      error = "Empty filter";
+      return false;
+    }
+
+    for (const std::string& pattern : term.patterns) {
+      if (kind == kKindIsa) {
+        uint32_t featureId = featureIdByName(pattern.c_str());
+        if (!featureId) {
+          error = "Unknown CPU feature '" + pattern + "'";
+          return false;
+        }
+        term.features.push_back(featureId);
+      }
+      else if (kind == kKindWidth && !isValidWidth(pattern)) {
+        error = "Unknown register kind '" + pattern + "', use r8|r16|r32|r64|mm|xmm|ymm|zmm|k";
+        return false;
+      }
+      else if (kind == kKindOperand && !isValidKind(pattern)) {
+        error = "Unknown operand kind '" + pattern + "', use reg|mem|imm|rel";
+        return false;
+      }
+    }
+  }
+
+  _terms.push_back(std::move(term));
+  return true;
+}
+
+bool InstFilter::matches(InstId instId, const InstSpec& instSpec, const char* name) const {
+  for (const Term& term : _terms)
+    if (_matchesTerm(term, instId, instSpec, name) == term.negate)
+      return false;
+  return true;
+}
+
+bool InstFilter::_matchesTerm(const Term& term, InstId instId, const InstSpec& instSpec, const char* name) const {
+  uint32_t opCount = instSpec.count();
+
+  switch (term.kind) {
+    case kKindMatch:
+      for (const std::string& pattern : term.patterns)
+        if (globMatch(pattern.c_str(), name))
+          return true;
+      return false;
+
+    case kKindRegex:
+      return std::regex_search(name, term.regex);
+
+    case kKindIsa: {
+      Operand operands[6];
+      uint32_t count = specToOperands(instSpec, operands);
+
+      CpuFeatures features;
+      if (InstAPI::queryFeatures(Arch::kHost, BaseInst(instId), operands, count, &features) != kErrorOk)
+        return false;
+
+      for (uint32_t featureId : term.features)
+        if (features.has(featureId))
+          return true;
+      return false;
+    }
+
+    case kKindWidth:
+    case kKindOperand:
+      for (uint32_t i = 0; i < opCount; i++) {
+        for (const std::string& pattern : term.patterns) {
+          bool matched = term.kind == kKindWidth ? opMatchesWidth(instSpec.get(i), pattern)
+                                                 : opMatchesKind(instSpec.get(i), pattern);
+          if (matched)
+            return true;
+        }
+      }
+      return false;
+
+    default:
+      return false;
+  }
+}
+
+// Matches the whole `str` against `pattern` having '*' and '?' wildcards.
+bool InstFilter::globMatch(const char* pattern, const char* str) {
+  const char* starP = nullptr;
+  const char* starS = nullptr;
+
+  while (*str) {
+    if (*pattern == '*') {
+      starP = ++pattern;
+      starS = str;
+    }
+    else if (*pattern == '?' || *pattern == *str) {
+      pattern++;
+      str++;
+    }
+    else if (starP) {
+      pattern = starP;
+      str = ++starS;
+    }
+    else {
+      return false;
+    }
+  }
+
+  while (*pattern == '*')
+    pattern++;
+  return *pattern == '\0';
+}
+
+// Returns the id of a CPU feature by its AsmJit name (case insensitive), or zero.
+uint32_t InstFilter::featureIdByName(const char* name) {
+  for (uint32_t featureId = 1; featureId < uint32_t(CpuFeatures::X86::kMaxValue) + 1; featureId++) {
+    StringTmp<64> featureName;
+    if (Formatter::formatFeature(featureName, Arch::kHost, featureId) != kErrorOk)
+      continue;
+
+    size_t size = strlen(name);
+    if (featureName.size() != size)
+      continue;
+
+    size_t i = 0;
+    while (i < size && toupper((unsigned char)name[i]) == toupper((unsigned char)featureName.data()[i]))
+      i++;
+
+    if (i == size)
+      return featureId;
+  }
+
+  return 0;
+}
+
+} // cult namespace
@@ -0,0 +1,64 @@
+#ifndef _CULT_INSTFILTER_H
+#define _CULT_INSTFILTER_H
+
+#include "globals.h"
+
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace cult {
+
+struct InstSpec;
+
+// Selects specs to benchmark. A filter consists of terms, which all have to match
+// (AND). Each term has one or more comma separated alternatives, of which at least
+// one has to match (OR), and can be negated by a leading '!':
+//
+//   --match=vadd*,vsub*   - Glob over the printed spec like "vaddps xmm, xmm, xmm".
+//   --regex=^v.*ps\b      - Regular expression (ECMAScript) over the printed spec.
+//   --isa=AVX512_BW,BMI2  - Spec requires any of the given CPU features.
+//   --width=ymm,zmm       - Spec has any operand of the given register kind.
+//   --operand=!mem        - Spec has any operand of the given kind (reg|mem|imm|rel).
+class InstFilter {
+public:
+  enum Kind : uint32_t {
+    kKindMatch = 0,
+    kKindRegex,
+    kKindIsa,
+    kKindWidth,
+    kKindOperand
+  };
+
+  struct Term {
+    Kind kind;
+    bool negate;
+    // Glob patterns, register kind names (`kKindWidth`) or operand kind names
+    // (`kKindOperand`).
+    std::vector<std::string> patterns;
+    // CPU feature ids (`kKindIsa`).
+    std::vector<uint32_t> features;
+    // Compiled regular expression (`kKindRegex`).
+    std::regex regex;
+  };
+
+  inline bool empty() const { return _terms.empty(); }
+
+  // Adds a term of the given `kind` parsed from a command line `value`. Returns
+  // false and fills `error` if the value is invalid.
+  bool addTerm(Kind kind, const char* value, std::string& error);
+
+  // Returns true if the spec (printed as `name`) matches all terms.
+  bool matches(InstId instId, const InstSpec& instSpec, const char* name) const;
+
+  bool _matchesTerm(const Term& term, InstId instId, const InstSpec& instSpec, const char* name) const;
+
+  static bool globMatch(const char* pattern, const char* str);
+  static uint32_t featureIdByName(const char* name);
+
+  std::vector<Term> _terms;
+};
+
+} // cult namespace
+
+#endif // _CULT_INSTFILTER_H
@@ -1,15 +1,49 @@
 #include "jsonbuilder.h"
 
+#include <string.h>
+
 namespace cult {
 
+// Appends `str` as the content of a JSON string - quotes, backslashes and control
+// characters are escaped, so strings read from the host (like hypervisor vendor
+// or vulnerability texts) can't break the document.
+static void appendEscaped(String* dst, const char* str, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    char c = str[i];
+    switch (c) {
+      case '\"': dst->append("\\\""); break;
+      case '\\': dst->append("\\\\"); break;
+      case '\b': dst->append("\\b"); break;
+      case '\f': dst->append("\\f"); break;
+      case '\n': dst->append("\\n"); break;
+      case '\r': dst->append("\\r"); break;
+      case '\t': dst->append("\\t"); break;
+      default:
+        if (uint8_t(c) < 0x20)
+          dst->appendFormat("\\u%04X", unsigned(uint8_t(c)));
+        else
+          dst->append(c);
+        break;
+    }
+  }
+}
+
 JSONBuilder::JSONBuilder(String* dst)
   : _dst(dst),
     _last(kTokenNone),
-    _level(0) {}
+    _level(0),
+    _format(kFormatDocument),
+    _exploded(false) {}
 
 JSONBuilder& JSONBuilder::openArray() {
-  if (_last == kTokenValue)
-    _dst->append(',');
+  if (_format == kFormatNDJSON && _level == 0) {
+    _exploded = true;
+    _last = kTokenNone;
+    _level++;
+    return *this;
+  }
+
+  _beforeValue();
 
   _dst->append('[');
   _last = kTokenNone;
@@ -20,20 +54,25 @@ JSONBuilder& JSONBuilder::openArray() {
 
 JSONBuilder& JSONBuilder::closeArray(bool nl) {
   _level--;
-  if (nl) {
+  if (_format == kFormatNDJSON && _exploded && _level == 0) {
+    _exploded = false;
+    _last = kTokenNone;
+    return *this;
+  }
+
+  if (nl && _format == kFormatDocument) {
     _dst->append('\n');
     _dst->appendChars(' ', _level * 2);
   }
 
   _dst->append(']');
-  _last = kTokenValue;
+  _afterValue();
 
   return *this;
 }
 
 JSONBuilder& JSONBuilder::openObject() {
-  if (_last == kTokenValue)
-    _dst->append(',');
+  _beforeValue();
 
   _dst->append('{');
   _last = kTokenNone;
@@ -44,17 +83,23 @@ JSONBuilder& JSONBuilder::openObject() {
 
 JSONBuilder& JSONBuilder::closeObject(bool nl) {
   _level--;
-  if (nl) {
+  if (nl && _format == kFormatDocument) {
     _dst->append('\n');
     _dst->appendChars(' ', _level * 2);
   }
 
   _dst->append('}');
-  _last = kTokenValue;
+  _afterValue();
   return *this;
 }
 
 JSONBuilder& JSONBuilder::addKey(const char* str) {
+  if (_format == kFormatNDJSON && _level == 0) {
+    _lineKey.assign(str);
+    _last = kTokenNone;
+    return *this;
+  }
+
   addString(str);
 
   _dst->append(':');
@@ -64,61 +109,51 @@ JSONBuilder& JSONBuilder::addKey(const char* str) {
 }
 
 JSONBuilder& JSONBuilder::addBool(bool b) {
-  if (_last == kTokenValue)
-    _dst->append(',');
-
+  _beforeValue();
   _dst->append(b ? "true" : "false");
-  _last = kTokenValue;
+  _afterValue();
 
   return *this;
 }
 
 JSONBuilder& JSONBuilder::addInt(int64_t n) {
-  if (_last == kTokenValue)
-    _dst->append(',');
-
+  _beforeValue();
   _dst->appendInt(n);
-  _last = kTokenValue;
+  _afterValue();
 
   return *this;
 }
 
 JSONBuilder& JSONBuilder::addUInt(uint64_t n) {
-  if (_last == kTokenValue)
-    _dst->append(',');
-
+  _beforeValue();
   _dst->appendUInt(n);
-  _last = kTokenValue;
+  _afterValue();
 
   return *this;
 }
 
 JSONBuilder& JSONBuilder::addDouble(double d) {
-  if (_last == kTokenValue)
-    _dst->append(',');
-
+  _beforeValue();
   _dst->appendFormat("%g", d);
-  _last = kTokenValue;
+  _afterValue();
 
   return *this;
 }
 
 JSONBuilder& JSONBuilder::addDoublef(const char* fmt, double d) {
-  if (_last == kTokenValue)
-    _dst->append(',');
-
+  _beforeValue();
   _dst->appendFormat(fmt, d);
-  _last = kTokenValue;
+  _afterValue();
 
   return *this;
 }
 
 JSONBuilder& JSONBuilder::addString(const char* str) {
-  if (_last == kTokenValue)
-    _dst->append(',');
-
-  _dst->appendFormat("\"%s\"", str);
-  _last = kTokenValue;
+  _beforeValue();
+  _dst->append('\"');
+  appendEscaped(_dst, str, strlen(str));
+  _dst->append('\"');
+  _afterValue();
 
   return *this;
 }
@@ -127,17 +162,24 @@ JSONBuilder& JSONBuilder::addStringf(const char* fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
 
-  _dst->append('\"');
-  _dst->appendVFormat(fmt, ap);
-  _dst->append('\"');
-  _last = kTokenValue;
+  StringTmp<256> str;
+  str.appendVFormat(fmt, ap);
 
   va_end(ap);
 
+  _beforeValue();
+  _dst->append('\"');
+  appendEscaped(_dst, str.data(), str.size());
+  _dst->append('\"');
+  _afterValue();
+
   return *this;
 }
 
 JSONBuilder& JSONBuilder::alignTo(size_t n) {
+  if (_format == kFormatNDJSON)
+    return *this;
+
   size_t i = _dst->size();
   const char* p = _dst->data();
 
@@ -153,6 +195,13 @@ JSONBuilder& JSONBuilder::alignTo(size_t n) {
 }
 
 JSONBuilder& JSONBuilder::beforeRecord() {
+  if (_format == kFormatNDJSON) {
+    if (_last == kTokenValue && !_isLineStart())
+      _dst->append(',');
+    _last = kTokenNone;
+    return *this;
+  }
+
   if (_last == kTokenValue)
     _dst->append(',');
 
@@ -163,4 +212,28 @@ JSONBuilder& JSONBuilder::beforeRecord() {
   return *this;
 }
 
+void JSONBuilder::_beforeValue() {
+  if (_isLineStart()) {
+    _dst->append('{');
+    _dst->append(_lineTag);
+    _dst->append('\"');
+    _dst->append(_lineKey);
+    _dst->append("\":");
+    return;
+  }
+
+  if (_last == kTokenValue)
+    _dst->append(',');
+}
+
+void JSONBuilder::_afterValue() {
+  if (_isLineStart()) {
+    _dst->append("}\n");
+    _last = kTokenNone;
+    return;
+  }
+
+  _last = kTokenValue;
+}
+
 } // cult namespace
@@ -12,8 +12,28 @@ public:
     kTokenValue = 1
   };
 
+  // Output format:
+  //
+  //   - kFormatDocument - a single JSON document, the caller opens and closes
+  //                       the root object.
+  //   - kFormatNDJSON   - newline delimited JSON, each top-level member becomes
+  //                       a single line `{"key":value}` and each element of a
+  //                       top-level array becomes a line `{"key":element}`. The
+  //                       caller doesn't open the root object in this mode.
+  enum Format : uint32_t {
+    kFormatDocument = 0,
+    kFormatNDJSON   = 1
+  };
+
   JSONBuilder(String* dst);
 
+  inline Format format() const { return _format; }
+  inline void setFormat(Format format) { _format = format; }
+
+  // Sets members written at the start of each line in NDJSON mode, like
+  // `"coreType":"p-core",` (must be empty or end with a comma).
+  inline void setLineTag(const char* tag) { _lineTag.assign(tag); }
+
   JSONBuilder& openArray();
   JSONBuilder& closeArray(bool nl = false);
 
@@ -33,12 +53,26 @@ public:
   JSONBuilder& alignTo(size_t n);
   JSONBuilder& beforeRecord();
 
-  JSONBuilder& nl() { _dst->append('\n'); return *this; }
-  JSONBuilder& indent() { _dst->appendChars(' ', _level); return *this; }
+  JSONBuilder& nl() { if (_format == kFormatDocument) _dst->append('\n'); return *this; }
+  JSONBuilder& indent() { if (_format == kFormatDocument) _dst->appendChars(' ', _level); return *this; }
+
+  // True if the next value starts a line in NDJSON mode.
+  inline bool _isLineStart() const {
+    return _format == kFormatNDJSON && (_level == 0 || (_exploded && _level == 1));
+  }
+
+  void _beforeValue();
+  void _afterValue();
 
   String* _dst;
   uint32_t _last;
   uint32_t _level;
+  Format _format;
+  // NDJSON mode - key of the current top-level member and whether it's an array
+  // whose elements are written as separate lines.
+  String _lineKey;
+  String _lineTag;
+  bool _exploded;
 };
 
 } // cult namespace
@@ -0,0 +1,289 @@
+#include "jsonreader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace cult {
+
+JSONReader::JSONReader()
+  : _start(nullptr),
+    _p(nullptr),
+    _end(nullptr),
+    _error(nullptr),
+    _errorOffset(0) {}
+
+bool JSONReader::parse(const char* data, size_t size) {
+  // Numbers are parsed by `strtod()`, which requires a null terminated input.
+  std::string buffer(data, size);
+
+  _nodes.clear();
+  _start = buffer.c_str();
+  _p = _start;
+  _end = _start + size;
+  _error = nullptr;
+  _errorOffset = 0;
+
+  uint32_t root = _parseValue(0);
+  if (root != kNone) {
+    _skipWhitespace();
+    if (_p != _end)
+      root = _fail("Unexpected data after the root value");
+  }
+
+  _start = _p = _end = nullptr;
+  if (root == kNone) {
+    _nodes.clear();
+    return false;
+  }
+
+  return true;
+}
+
+bool JSONReader::parseFile(const char* fileName) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file) {
+    _error = "Couldn't open the file";
+    _errorOffset = 0;
+    return false;
+  }
+
+  std::string content;
+  char buf[65536];
+
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) != 0)
+    content.append(buf, n);
+  fclose(file);
+
+  return parse(content.data(), content.size());
+}
+
+uint32_t JSONReader::find(uint32_t object, const char* key) const {
+  if (object == kNone || _nodes[object].type != kTypeObject)
+    return kNone;
+
+  for (uint32_t i = _nodes[object].first; i != kNone; i = _nodes[i].next)
+    if (_nodes[i].key == key)
+      return i;
+  return kNone;
+}
+
+double JSONReader::numberOf(uint32_t object, const char* key, double defaultValue) const {
+  uint32_t i = find(object, key);
+  if (i == kNone || _nodes[i].type != kTypeNumber)
+    return defaultValue;
+  return _nodes[i].number;
+}
+
+uint32_t JSONReader::_parseValue(uint32_t depth) {
+  if (depth > kMaxDepth)
+    return _fail("Maximum nesting depth exceeded");
+
+  _skipWhitespace();
+  if (_p == _end)
+    return _fail("Unexpected end of input");
+
+  char c = *_p;
+
+  if (c == '{' || c == '[') {
+    bool isObject = c == '{';
+    char terminator = isObject ? '}' : ']';
+
+    uint32_t index = _newNode(isObject ? kTypeObject : kTypeArray);
+    uint32_t last = kNone;
+
+    _p++;
+    _skipWhitespace();
+
+    if (_p != _end && *_p == terminator) {
+      _p++;
+      return index;
+    }
+
+    for (;;) {
+      std::string key;
+      if (isObject) {
+        _skipWhitespace();
+        if (_p == _end || *_p != '\"')
+          return _fail("Expected a key");
+
+        if (!_parseString(key))
+          return kNone;
+
+        _skipWhitespace();
+        if (_p == _end || *_p != ':')
+          return _fail("Expected ':'");
+        _p++;
+      }
+
+      uint32_t child = _parseValue(depth + 1);
+      if (child == kNone)
+        return kNone;
+
+      _nodes[child].key.swap(key);
+
+      if (last == kNone)
+        _nodes[index].first = child;
+      else
+        _nodes[last].next = child;
+      last = child;
+
+      _skipWhitespace();
+      if (_p == _end)
+        return _fail("Unexpected end of input");
+
+      if (*_p == ',') {
+        _p++;
+        continue;
+      }
+
+      if (*_p == terminator) {
+        _p++;
+        return index;
+      }
+
+      return _fail(isObject ? "Expected ',' or '}'" : "Expected ',' or ']'");
+    }
+  }
+
+  if (c == '\"') {
+    std::string str;
+    if (!_parseString(str))
+      return kNone;
+
+    uint32_t index = _newNode(kTypeString);
+    _nodes[index].str.swap(str);
+    return index;
+  }
+
+  if (size_t(_end - _p) >= 4 && memcmp(_p, "null", 4) == 0) {
+    _p += 4;
+    return _newNode(kTypeNull);
+  }
+
+  if (size_t(_end - _p) >= 4 && memcmp(_p, "true", 4) == 0) {
+    _p += 4;
+    uint32_t index = _newNode(kTypeBool);
+    _nodes[index].b = true;
+    return index;
+  }
+
+  if (size_t(_end - _p) >= 5 && memcmp(_p, "false", 5) == 0) {
+    _p += 5;
+    return _newNode(kTypeBool);
+  }
+
+  if (c == '-' || (c >= '0' && c <= '9')) {
+    char* numberEnd = nullptr;
+    double number = strtod(_p, &numberEnd);
+
+    if (numberEnd == _p)
+      return _fail("Invalid number");
+
+    _p = numberEnd;
+    uint32_t index = _newNode(kTypeNumber);
+    _nodes[index].number = number;
+    return index;
+  }
+
+  return _fail("Unexpected character");
+}
+
+bool JSONReader::_parseString(std::string& out) {
+  // Skip the opening quote.
+  _p++;
+
+  while (_p != _end) {
+    char c = *_p++;
+
+    if (c == '\"')
+      return true;
+
+    if (c != '\\') {
+      out.push_back(c);
+      continue;
+    }
+
+    if (_p == _end)
+      break;
+
+    c = *_p++;
+    switch (c) {
+      case '\"': out.push_back('\"'); break;
+      case '\\': out.push_back('\\'); break;
+      case '/' : out.push_back('/'); break;
+      case 'b' : out.push_back('\b'); break;
+      case 'f' : out.push_back('\f'); break;
+      case 'n' : out.push_back('\n'); break;
+      case 'r' : out.push_back('\r'); break;
+      case 't' : out.push_back('\t'); break;
+
+      case 'u': {
+        if (size_t(_end - _p) < 4) {
+          _fail("Invalid unicode escape");
+          return false;
+        }
+
+        char hex[5] = { _p[0], _p[1], _p[2], _p[3], '\0' };
+        char* hexEnd = nullptr;
+        uint32_t cp = uint32_t(strtoul(hex, &hexEnd, 16));
+
+        if (hexEnd != hex + 4) {
+          _fail("Invalid unicode escape");
+          return false;
+        }
+        _p += 4;
+
+        // Encode as UTF-8 (surrogates are kept as is, cult never produces them).
+        if (cp < 0x80u) {
+          out.push_back(char(cp));
+        }
+        else if (cp < 0x800u) {
+          out.push_back(char(0xC0u | (cp >> 6)));
+          out.push_back(char(0x80u | (cp & 0x3Fu)));
+        }
+        else {
+          out.push_back(char(0xE0u | (cp >> 12)));
+          out.push_back(char(0x80u | ((cp >> 6) & 0x3Fu)));
+          out.push_back(char(0x80u | (cp & 0x3Fu)));
+        }
+        break;
+      }
+
+      default:
+        _fail("Invalid escape sequence");
+        return false;
+    }
+  }
+
+  _fail("Unterminated string");
+  return false;
+}
+
+uint32_t JSONReader::_newNode(Type type) {
+  Node node;
+  node.type = type;
+  node.first = kNone;
+  node.next = kNone;
+  node.b = false;
+  node.number = 0.0;
+
+  _nodes.push_back(node);
+  return uint32_t(_nodes.size() - 1);
+}
+
+void JSONReader::_skipWhitespace() {
+  while (_p != _end && (*_p == ' ' || *_p == '\t' || *_p == '\n' || *_p == '\r'))
+    _p++;
+}
+
+uint32_t JSONReader::_fail(const char* error) {
+  if (!_error) {
+    _error = error;
+    _errorOffset = size_t(_p - _start);
+  }
+  return kNone;
+}
+
+} // cult namespace
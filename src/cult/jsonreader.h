@@ -0,0 +1,72 @@
+#ifndef _CULT_JSONREADER_H
+#define _CULT_JSONREADER_H
+
+#include "globals.h"
+
+#include <string>
+#include <vector>
+
+namespace cult {
+
+// A minimal JSON parser used to read documents produced by cult itself (like a
+// baseline to verify against). All values are stored in a flat array of nodes,
+// children of arrays and objects are linked through `first` and `next` indexes.
+class JSONReader {
+public:
+  enum Type : uint32_t {
+    kTypeNull = 0,
+    kTypeBool,
+    kTypeNumber,
+    kTypeString,
+    kTypeArray,
+    kTypeObject
+  };
+
+  static constexpr uint32_t kNone = 0xFFFFFFFFu;
+  static constexpr uint32_t kMaxDepth = 256;
+
+  struct Node {
+    Type type;
+    uint32_t first;
+    uint32_t next;
+    bool b;
+    double number;
+    // String value (strings) and key (members of objects).
+    std::string str;
+    std::string key;
+  };
+
+  JSONReader();
+
+  bool parse(const char* data, size_t size);
+  bool parseFile(const char* fileName);
+
+  inline uint32_t root() const { return _nodes.empty() ? kNone : 0u; }
+  inline const Node& node(uint32_t index) const { return _nodes[index]; }
+
+  inline const char* error() const { return _error; }
+  inline size_t errorOffset() const { return _errorOffset; }
+
+  // Returns the index of member `key` of `object` or `kNone`.
+  uint32_t find(uint32_t object, const char* key) const;
+
+  // Returns the number of `key` member of `object` or `defaultValue`.
+  double numberOf(uint32_t object, const char* key, double defaultValue) const;
+
+  uint32_t _parseValue(uint32_t depth);
+  bool _parseString(std::string& out);
+  uint32_t _newNode(Type type);
+  void _skipWhitespace();
+  uint32_t _fail(const char* error);
+
+  std::vector<Node> _nodes;
+  const char* _start;
+  const char* _p;
+  const char* _end;
+  const char* _error;
+  size_t _errorOffset;
+};
+
+} // cult namespace
+
+#endif // _CULT_JSONREADER_H
@@ -0,0 +1,645 @@
+#include "listing.h"
+#include "instbench.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace cult {
+
+// Prefixes printed before the mnemonic, which don't change the instruction form.
+static const char* const kIgnoredPrefixes[] = {
+  "lock", "rep", "repe", "repz", "repne", "repnz", "data16", "data32", "addr16", "addr32",
+  "cs", "ds", "es", "fs", "gs", "ss", "notrack", "bnd", "xacquire", "xrelease",
+  "{vex}", "{vex2}", "{vex3}", "{evex}"
+};
+
+// AT&T mnemonics that differ from Intel ones (other than by a size suffix).
+static const char* const kAttAliases[][2] = {
+  { "cbtw"  , "cbw"    },
+  { "cwtl"  , "cwde"   },
+  { "cltq"  , "cdqe"   },
+  { "cwtd"  , "cwd"    },
+  { "cltd"  , "cdq"    },
+  { "cqto"  , "cqo"    },
+  { "movabs", "mov"    },
+  { "movslq", "movsxd" }
+};
+
+static const char* const kGpRegs[4][12] = {
+  { "al" , "cl" , "dl" , "bl" , "ah" , "ch" , "dh" , "bh" , "spl", "bpl", "sil", "dil" },
+  { "ax" , "cx" , "dx" , "bx" , "sp" , "bp" , "si" , "di" , nullptr },
+  { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", nullptr },
+  { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", nullptr }
+};
+
+static const uint32_t kGpKinds[4] = { InstSpec::kOpGpb, InstSpec::kOpGpw, InstSpec::kOpGpd, InstSpec::kOpGpq };
+
+static std::string trim(const std::string& s) {
+  size_t start = 0;
+  size_t end = s.size();
+
+  while (start < end && isspace((unsigned char)s[start]))
+    start++;
+  while (end > start && isspace((unsigned char)s[end - 1]))
+    end--;
+  return s.substr(start, end - start);
+}
+
+static std::string toLower(std::string s) {
+  for (char& c : s)
+    c = char(tolower((unsigned char)c));
+  return s;
+}
+
+static bool startsWith(const std::string& s, const char* prefix) {
+  return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+static bool isNumber(const std::string& s) {
+  size_t i = (!s.empty() && (s[0] == '-' || s[0] == '+')) ? 1 : 0;
+  if (i >= s.size() || !isdigit((unsigned char)s[i]))
+    return false;
+
+  for (; i < s.size(); i++)
+    if (!isxdigit((unsigned char)s[i]) && s[i] != 'x' && s[i] != 'X')
+      return false;
+  return true;
+}
+
+// Returns true if `s` is a branch target printed by objdump, which is a bare hex
+// address without `0x` (like `a1b2c`), or any other number.
+static bool isBranchTarget(const std::string& s) {
+  if (isNumber(s))
+    return true;
+
+  if (s.empty())
+    return false;
+
+  for (char c : s)
+    if (!isxdigit((unsigned char)c))
+      return false;
+  return true;
+}
+
+static bool isDigits(const std::string& s, size_t from) {
+  if (from >= s.size())
+    return false;
+
+  for (size_t i = from; i < s.size(); i++)
+    if (!isdigit((unsigned char)s[i]))
+      return false;
+  return true;
+}
+
+// Returns the `InstSpec` operand kind of a register name (without '%'), or zero.
+static uint32_t regKindOf(const std::string& name) {
+  if (startsWith(name, "xmm") && isDigits(name, 3)) return InstSpec::kOpXmm;
+  if (startsWith(name, "ymm") && isDigits(name, 3)) return InstSpec::kOpYmm;
+  if (startsWith(name, "zmm") && isDigits(name, 3)) return InstSpec::kOpZmm;
+  if (startsWith(name, "mm") && isDigits(name, 2)) return InstSpec::kOpMm;
+  if (startsWith(name, "k") && isDigits(name, 1)) return InstSpec::kOpKReg;
+
+  for (uint32_t kind = 0; kind < 4; kind++)
+    for (uint32_t i = 0; i < 12 && kGpRegs[kind][i]; i++)
+      if (name == kGpRegs[kind][i])
+        return kGpKinds[kind];
+
+  // r8..r15 with an optional size suffix.
+  if (name.size() >= 2 && name[0] == 'r' && isdigit((unsigned char)name[1])) {
+    size_t end = 1;
+    while (end < name.size() && isdigit((unsigned char)name[end]))
+      end++;
+
+    std::string suffix = name.substr(end);
+    if (suffix.empty()) return InstSpec::kOpGpq;
+    if (suffix == "d") return InstSpec::kOpGpd;
+    if (suffix == "w") return InstSpec::kOpGpw;
+    if (suffix == "b" || suffix == "l") return InstSpec::kOpGpb;
+  }
+
+  return 0;
+}
+
+// Memory operand split into the parts used by `lea` specs.
+struct MemOperand {
+  uint32_t kind;
+  uint32_t base;
+  uint32_t index;
+  bool hasDisp;
+  // Relative to the instruction pointer (`rip` or `eip` base), only its size
+  // matters to specs other than `lea`.
+  bool ripRelative;
+  bool valid;
+};
+
+static bool isInstPointer(const std::string& name) {
+  return name == "rip" || name == "eip";
+}
+
+static MemOperand parseAttMem(const std::string& op) {
+  MemOperand mem { Listing::kOpAnyMem, 0, 0, false, false, true };
+
+  // Skip a segment override like "%fs:".
+  std::string s = op;
+  size_t colon = s.find(':');
+  if (colon != std::string::npos)
+    s = s.substr(colon + 1);
+
+  size_t paren = s.find('(');
+  mem.hasDisp = trim(s.substr(0, paren)).size() != 0;
+
+  if (paren != std::string::npos) {
+    size_t close = s.find(')', paren);
+    std::string inner = s.substr(paren + 1, close == std::string::npos ? std::string::npos : close - paren - 1);
+
+    size_t comma = inner.find(',');
+    std::string base = trim(inner.substr(0, comma));
+    std::string index;
+
+    if (comma != std::string::npos) {
+      size_t comma2 = inner.find(',', comma + 1);
+      index = trim(inner.substr(comma + 1, comma2 == std::string::npos ? std::string::npos : comma2 - comma - 1));
+    }
+
+    if (!base.empty() && base[0] == '%' && isInstPointer(base.substr(1))) {
+      mem.ripRelative = true;
+    }
+    else if (!base.empty()) {
+      mem.base = base[0] == '%' ? regKindOf(base.substr(1)) : 0;
+      mem.valid &= mem.base != 0;
+    }
+
+    if (!index.empty()) {
+      mem.index = index[0] == '%' ? regKindOf(index.substr(1)) : 0;
+      mem.valid &= mem.index != 0;
+    }
+  }
+
+  return mem;
+}
+
+static MemOperand parseIntelMem(const std::string& op) {
+  MemOperand mem { Listing::kOpAnyMem, 0, 0, false, false, true };
+
+  static const struct {
+    const char* prefix;
+    uint32_t kind;
+  } sizes[] = {
+    { "byte ptr"   , InstSpec::kOpMem8   },
+    { "word ptr"   , InstSpec::kOpMem16  },
+    { "dword ptr"  , InstSpec::kOpMem32  },
+    { "qword ptr"  , InstSpec::kOpMem64  },
+    { "xmmword ptr", InstSpec::kOpMem128 },
+    { "ymmword ptr", InstSpec::kOpMem256 },
+    { "zmmword ptr", InstSpec::kOpMem512 }
+  };
+
+  for (const auto& size : sizes) {
+    if (startsWith(op, size.prefix)) {
+      mem.kind = size.kind;
+      break;
+    }
+  }
+
+  size_t open = op.find('[');
+  size_t close = op.find(']');
+
+  if (open == std::string::npos || close == std::string::npos || close < open) {
+    // Absolute address like "ds:0x404040".
+    mem.hasDisp = true;
+    return mem;
+  }
+
+  std::string inner = op.substr(open + 1, close - open - 1);
+  size_t i = 0;
+
+  while (i < inner.size()) {
+    size_t end = inner.find_first_of("+-", i + 1);
+    std::string term = trim(inner.substr(i, end == std::string::npos ? std::string::npos : end - i));
+
+    if (!term.empty() && (term[0] == '+' || term[0] == '-'))
+      term = trim(term.substr(1));
+
+    size_t star = term.find('*');
+    if (star != std::string::npos) {
+      mem.index = regKindOf(term.substr(0, star));
+      mem.valid &= mem.index != 0;
+    }
+    else if (isNumber(term)) {
+      mem.hasDisp = true;
+    }
+    else if (isInstPointer(term)) {
+      mem.ripRelative = true;
+    }
+    else if (!term.empty()) {
+      uint32_t reg = regKindOf(term);
+      mem.valid &= reg != 0;
+
+      if (!mem.base)
+        mem.base = reg;
+      else
+        mem.index = reg;
+    }
+
+    if (end == std::string::npos)
+      break;
+    i = end;
+  }
+
+  return mem;
+}
+
+// Splits operands at commas that are not nested in parentheses, brackets or braces.
+static void splitOperands(const std::string& s, std::vector<std::string>& dst) {
+  uint32_t depth = 0;
+  size_t start = 0;
+
+  for (size_t i = 0; i <= s.size(); i++) {
+    char c = i < s.size() ? s[i] : ',';
+
+    if (c == '(' || c == '[' || c == '{')
+      depth++;
+    else if ((c == ')' || c == ']' || c == '}') && depth)
+      depth--;
+    else if (c == ',' && depth == 0) {
+      std::string op = trim(s.substr(start, i - start));
+
+      // Remove AVX-512 decorations like "{k1}{z}", "{1to16}" or "{sae}".
+      std::string stripped;
+      uint32_t braces = 0;
+      for (char ch : op) {
+        if (ch == '{') braces++;
+        else if (ch == '}' && braces) braces--;
+        else if (!braces) stripped.push_back(ch);
+      }
+
+      stripped = trim(stripped);
+      if (!stripped.empty())
+        dst.push_back(stripped);
+      start = i + 1;
+    }
+  }
+}
+
+static InstId instIdByMnemonic(const std::string& mnemonic, bool att) {
+  InstId instId = InstAPI::stringToInstId(Arch::kHost, mnemonic.c_str(), mnemonic.size());
+  if (instId || !att)
+    return instId;
+
+  for (const auto& alias : kAttAliases)
+    if (mnemonic == alias[0])
+      return InstAPI::stringToInstId(Arch::kHost, alias[1], strlen(alias[1]));
+
+  // movsbl, movzwq, ... are movsx/movzx.
+  if (mnemonic.size() == 6 && (startsWith(mnemonic, "movs") || startsWith(mnemonic, "movz")) &&
+      strchr("bwlq", mnemonic[4]) && strchr("bwlq", mnemonic[5])) {
+    const char* name = mnemonic[3] == 's' ? "movsx" : "movzx";
+    return InstAPI::stringToInstId(Arch::kHost, name, strlen(name));
+  }
+
+  // Size suffix, like addl or vcvtsi2sdq.
+  if (mnemonic.size() > 2 && strchr("bwlq", mnemonic.back()))
+    return InstAPI::stringToInstId(Arch::kHost, mnemonic.c_str(), mnemonic.size() - 1);
+
+  return 0;
+}
+
+// ============================================================================
+// [cult::Listing]
+// ============================================================================
+
+Listing::Listing()
+  : _lines(0),
+    _unknownLines(0),
+    _ripLeaLines(0),
+    _totalWeight(0.0),
+    _unknownWeight(0.0),
+    _ripLeaWeight(0.0) {}
+
+bool Listing::load(const char* fileName) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file)
+    return false;
+
+  char line[1024];
+  while (fgets(line, sizeof(line), file))
+    _parseLine(line);
+
+  fclose(file);
+  return true;
+}
+
+void Listing::match(const std::vector<InstResult>& results, std::vector<double>& weights) {
+  std::unordered_map<uint32_t, std::vector<size_t>> byInstId;
+  for (size_t i = 0; i < results.size(); i++)
+    byInstId[results[i].instId].push_back(i);
+
+  for (Form& form : _forms) {
+    auto it = byInstId.find(form.instId);
+    if (it == byInstId.end())
+      continue;
+
+    std::vector<size_t> matching;
+    for (size_t index : it->second)
+      if (matches(form, results[index].instSpec))
+        matching.push_back(index);
+
+    // A form having wildcards may match multiple specs (like `i8` and `i32`
+    // immediates), its weight is split between them so the total is kept.
+    for (size_t index : matching)
+      weights[index] += form.weight / double(matching.size());
+
+    form.matched = !matching.empty();
+  }
+}
+
+bool Listing::matches(const Form& form, const InstSpec& instSpec) {
+  if (instSpec.count() != form.opCount)
+    return false;
+
+  for (uint32_t i = 0; i < form.opCount; i++) {
+    uint32_t op = instSpec.get(i);
+
+    // Implicit operands of specs are compared by their generic kind.
+    if (op >= InstSpec::kOpAl && op <= InstSpec::kOpBl)
+      op = InstSpec::kOpGpb;
+    else if (op >= InstSpec::kOpAx && op <= InstSpec::kOpBx)
+      op = InstSpec::kOpGpw;
+    else if (op >= InstSpec::kOpEax && op <= InstSpec::kOpEbx)
+      op = InstSpec::kOpGpd;
+    else if (op >= InstSpec::kOpRax && op <= InstSpec::kOpRbx)
+      op = InstSpec::kOpGpq;
+    else if (op == InstSpec::kOpXmm0)
+      op = InstSpec::kOpXmm;
+
+    uint32_t expected = form.ops[i];
+    if (expected == kOpAnyImm) {
+      if (op < InstSpec::kOpImm8 || op > InstSpec::kOpImm64)
+        return false;
+    }
+    else if (expected == kOpAnyMem) {
+      if (op < InstSpec::kOpMem8 || op > InstSpec::kOpMem512)
+        return false;
+    }
+    else if (op != expected) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Parses a single line of a listing, which is either an instruction having an
+// address like "  401126:\t55                   \tpush   %rbp" (objdump) or
+// "    0.52 :   401126:       push   %rbp" (perf annotate), or anything else,
+// which is ignored.
+bool Listing::_parseLine(char* line) {
+  std::string s(line);
+  while (!s.empty() && (s.back() == '\n' || s.back() == '\r'))
+    s.pop_back();
+
+  double weight = 1.0;
+
+  // Sample percentage of perf annotate, separated by ':', '|' or a box drawing
+  // character (UTF-8 encoded U+2502).
+  size_t sep = s.find_first_of(":|");
+  size_t box = s.find("\xE2\x94\x82");
+  size_t sepSize = 1;
+
+  if (box != std::string::npos && (sep == std::string::npos || box < sep)) {
+    sep = box;
+    sepSize = 3;
+  }
+
+  if (sep != std::string::npos) {
+    std::string head = trim(s.substr(0, sep));
+    char* end = nullptr;
+    double value = strtod(head.c_str(), &end);
+
+    if (!head.empty() && head.find('.') != std::string::npos && *end == '\0') {
+      weight = value;
+      s = s.substr(sep + sepSize);
+    }
+  }
+
+  // Address.
+  size_t i = 0;
+  while (i < s.size() && isspace((unsigned char)s[i]))
+    i++;
+
+  size_t addrStart = i;
+  while (i < s.size() && isxdigit((unsigned char)s[i]))
+    i++;
+
+  if (i == addrStart || i >= s.size() || s[i] != ':')
+    return false;
+
+  std::string text = s.substr(i + 1);
+
+  // objdump separates instruction bytes and the instruction by a tab.
+  size_t tab = text.rfind('\t');
+  if (tab != std::string::npos && text.find('\t') != tab)
+    text = text.substr(tab + 1);
+  else if (tab != std::string::npos && trim(text.substr(0, tab)).empty())
+    text = text.substr(tab + 1);
+
+  // Remove comments and symbolic targets like "<main+0x10>".
+  size_t hash = text.find('#');
+  if (hash != std::string::npos)
+    text.resize(hash);
+
+  size_t lt;
+  while ((lt = text.find('<')) != std::string::npos) {
+    size_t gt = text.find('>', lt);
+    text.erase(lt, gt == std::string::npos ? std::string::npos : gt - lt + 1);
+  }
+
+  text = trim(text);
+  if (text.empty())
+    return false;
+
+  // Continuation line having only instruction bytes.
+  bool onlyBytes = true;
+  for (char c : text)
+    if (!isxdigit((unsigned char)c) && c != ' ')
+      onlyBytes = false;
+
+  if (onlyBytes)
+    return false;
+
+  _lines++;
+  _totalWeight += weight;
+
+  if (!_parseInstruction(text.c_str(), weight)) {
+    _unknownLines++;
+    _unknownWeight += weight;
+    return false;
+  }
+
+  return true;
+}
+
+bool Listing::_parseInstruction(const char* text, double weight) {
+  std::string s(text);
+  std::string mnemonic;
+  size_t i = 0;
+
+  for (;;) {
+    while (i < s.size() && isspace((unsigned char)s[i]))
+      i++;
+
+    size_t start = i;
+    while (i < s.size() && !isspace((unsigned char)s[i]))
+      i++;
+
+    if (i == start)
+      return false;
+
+    std::string word = toLower(s.substr(start, i - start));
+
+    bool isPrefix = startsWith(word, "rex");
+    for (const char* prefix : kIgnoredPrefixes)
+      isPrefix |= word == prefix;
+
+    if (!isPrefix) {
+      mnemonic = word;
+      break;
+    }
+  }
+
+  std::vector<std::string> operands;
+  splitOperands(toLower(s.substr(i)), operands);
+
+  bool att = false;
+  for (const std::string& op : operands)
+    att |= op.find('%') != std::string::npos || op[0] == '$';
+
+  // AT&T mnemonics without operands (like cltq) still need the AT&T lookup.
+  InstId instId = instIdByMnemonic(mnemonic, att || operands.empty());
+  if (!instId)
+    return false;
+
+  bool isBranch = instId == x86::Inst::kIdCall || instId == x86::Inst::kIdJmp || mnemonic[0] == 'j';
+  bool isLea = instId == x86::Inst::kIdLea;
+
+  // Operands in Intel order, lea memory operands are split into their parts as
+  // used by lea specs.
+  std::vector<std::vector<uint32_t>> kinds;
+
+  for (std::string op : operands) {
+    std::vector<uint32_t> k;
+
+    if (att) {
+      if (op[0] == '*')
+        op = trim(op.substr(1));
+
+      if (op[0] == '$') {
+        k.push_back(kOpAnyImm);
+      }
+      else if (op[0] == '%' && op.find('(') == std::string::npos && op.find(':') == std::string::npos) {
+        k.push_back(regKindOf(op.substr(1)));
+      }
+      else if (isBranch && isBranchTarget(op)) {
+        k.push_back(InstSpec::kOpRel);
+      }
+      else {
+        MemOperand mem = parseAttMem(op);
+        if (!mem.valid)
+          return false;
+
+        if (isLea && mem.ripRelative)
+          return _skipRipLea(weight);
+
+        if (isLea) {
+          if (mem.base) k.push_back(mem.base);
+          if (mem.index) k.push_back(mem.index);
+          if (mem.hasDisp) k.push_back(kOpAnyImm);
+        }
+        else {
+          k.push_back(mem.kind);
+        }
+      }
+    }
+    else {
+      if (op.find('[') != std::string::npos || op.find("ptr") != std::string::npos || op.find(':') != std::string::npos) {
+        MemOperand mem = parseIntelMem(op);
+        if (!mem.valid)
+          return false;
+
+        if (isLea && mem.ripRelative)
+          return _skipRipLea(weight);
+
+        if (isLea) {
+          if (mem.base) k.push_back(mem.base);
+          if (mem.index) k.push_back(mem.index);
+          if (mem.hasDisp) k.push_back(kOpAnyImm);
+        }
+        else {
+          k.push_back(mem.kind);
+        }
+      }
+      else if (isBranch && isBranchTarget(op)) {
+        k.push_back(InstSpec::kOpRel);
+      }
+      else if (isNumber(op)) {
+        k.push_back(kOpAnyImm);
+      }
+      else {
+        k.push_back(regKindOf(op));
+      }
+    }
+
+    for (uint32_t kind : k)
+      if (!kind)
+        return false;
+
+    kinds.push_back(k);
+  }
+
+  if (att)
+    std::reverse(kinds.begin(), kinds.end());
+
+  Form form {};
+  form.instId = instId;
+  form.weight = weight;
+  form.count = 1;
+  form.matched = false;
+  form.text = s;
+
+  for (const std::vector<uint32_t>& k : kinds) {
+    for (uint32_t kind : k) {
+      if (form.opCount >= 6)
+        return false;
+      form.ops[form.opCount++] = kind;
+    }
+  }
+
+  std::string key(reinterpret_cast<const char*>(&form.instId), sizeof(form.instId));
+  key.append(reinterpret_cast<const char*>(form.ops), form.opCount * sizeof(uint32_t));
+
+  auto it = _formMap.find(key);
+  if (it != _formMap.end()) {
+    Form& existing = _forms[it->second];
+    existing.weight += weight;
+    existing.count++;
+  }
+  else {
+    _formMap[key] = _forms.size();
+    _forms.push_back(form);
+  }
+
+  return true;
+}
+
+// `lea` relative to the instruction pointer has no benchmarked form as all `lea`
+// specs have a base register. Such lines are counted separately instead of being
+// reported as unknown.
+bool Listing::_skipRipLea(double weight) {
+  _ripLeaLines++;
+  _ripLeaWeight += weight;
+  return true;
+}
+
+} // cult namespace
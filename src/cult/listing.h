@@ -0,0 +1,74 @@
+#ifndef _CULT_LISTING_H
+#define _CULT_LISTING_H
+
+#include "globals.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cult {
+
+struct InstResult;
+struct InstSpec;
+
+// Instruction forms used by a program, parsed from a disassembly listing (see
+// `--from-listing`). Accepts the output of `objdump -d` in both AT&T and Intel
+// (`-M intel`) syntax and the output of `perf annotate --stdio`, in which case
+// each instruction is weighted by its sample percentage instead of by 1.
+//
+// Operands are mapped to `InstSpec` operand kinds. Register operands map to
+// their generic kind (`rcx` is `kOpGpq`), immediates and memory operands of an
+// unknown size map to wildcards, which match any size. RIP-relative memory
+// operands map like any other memory operand.
+class Listing {
+public:
+  enum : uint32_t {
+    kOpAnyImm = 0xFE,
+    kOpAnyMem = 0xFF
+  };
+
+  struct Form {
+    InstId instId;
+    uint32_t opCount;
+    uint32_t ops[6];
+    // Sum of weights and number of occurrences of the form.
+    double weight;
+    uint32_t count;
+    // True if the form matched at least one classified spec.
+    bool matched;
+    // Text of the first occurrence, for diagnostics.
+    std::string text;
+  };
+
+  Listing();
+
+  bool load(const char* fileName);
+
+  // Adds weights of matching forms to `weights` (indexed the same as `results`)
+  // and marks forms that matched any result.
+  void match(const std::vector<InstResult>& results, std::vector<double>& weights);
+
+  static bool matches(const Form& form, const InstSpec& instSpec);
+
+  bool _parseLine(char* line);
+  bool _parseInstruction(const char* text, double weight);
+  bool _skipRipLea(double weight);
+
+  std::vector<Form> _forms;
+  std::unordered_map<std::string, size_t> _formMap;
+
+  // Number and weight of instruction lines, including those that couldn't be
+  // mapped to any instruction or operand kind (`_unknown*`) and RIP-relative
+  // `lea` instructions, which have no benchmarked form (`_ripLea*`).
+  uint32_t _lines;
+  uint32_t _unknownLines;
+  uint32_t _ripLeaLines;
+  double _totalWeight;
+  double _unknownWeight;
+  double _ripLeaWeight;
+};
+
+} // cult namespace
+
+#endif // _CULT_LISTING_H
@@ -0,0 +1,115 @@
+#include "noisemonitor.h"
+#include "cpuutils.h"
+#include "schedutils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace cult {
+
+// A batch taking longer than the fastest batch of the test by both of these is a gap.
+static constexpr double kGapRelative = 0.05;
+static constexpr uint64_t kGapTicks = 20000;
+
+NoiseMonitor::NoiseMonitor()
+  : _initialized(false),
+    _interruptsFd(-1),
+    _cpu(0),
+    _startSwitches(0),
+    _startInterrupts(0),
+    _startTsc(0),
+    _minElapsed(0) {}
+
+NoiseMonitor::~NoiseMonitor() {
+#if defined(__linux__)
+  if (_interruptsFd != -1)
+    close(_interruptsFd);
+#endif
+}
+
+void NoiseMonitor::init() {
+#if defined(__linux__)
+  int cpu = sched_getcpu();
+  _cpu = cpu >= 0 ? uint32_t(cpu) : 0u;
+  _interruptsFd = open("/proc/interrupts", O_RDONLY);
+#endif
+
+  _buffer.resize(65536);
+  _initialized = true;
+}
+
+void NoiseMonitor::beginBatch() {
+  _startSwitches = _contextSwitches();
+  _startInterrupts = _interrupts();
+  _startTsc = CpuUtils::rdtsc();
+}
+
+uint32_t NoiseMonitor::endBatch() {
+  uint64_t elapsed = CpuUtils::rdtsc() - _startTsc;
+  uint32_t sources = kSourceNone;
+
+  if (_contextSwitches() != _startSwitches)
+    sources |= kSourceContextSwitch;
+
+  // Read last as reading /proc/interrupts is the slowest.
+  if (_interrupts() != _startInterrupts)
+    sources |= kSourceInterrupt;
+
+  if (!_minElapsed || elapsed < _minElapsed) {
+    _minElapsed = elapsed;
+  }
+  else {
+    uint64_t excess = elapsed - _minElapsed;
+    if (excess > kGapTicks && double(excess) > double(_minElapsed) * kGapRelative)
+      sources |= kSourceGap;
+  }
+
+  return sources;
+}
+
+uint64_t NoiseMonitor::_contextSwitches() {
+#if defined(__linux__) && defined(RUSAGE_THREAD)
+  rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage) == 0)
+    return uint64_t(usage.ru_nivcsw);
+#endif
+  return 0;
+}
+
+// Returns the number of interrupts handled by the CPU of the thread. Reads the
+// file via a descriptor opened once as it's read twice per batch.
+uint64_t NoiseMonitor::_interrupts() {
+#if defined(__linux__)
+  if (_interruptsFd == -1)
+    return 0;
+
+  size_t size = 0;
+  for (;;) {
+    ssize_t n = pread(_interruptsFd, _buffer.data() + size, _buffer.size() - size - 1, off_t(size));
+    if (n <= 0)
+      break;
+
+    size += size_t(n);
+    if (size + 1 == _buffer.size())
+      _buffer.resize(_buffer.size() * 2);
+  }
+  _buffer[size] = '\0';
+
+  if (!SchedUtils::parseInterrupts(_buffer.data(), _counts) || _cpu >= _counts.size())
+    return 0;
+
+  return _counts[_cpu];
+#else
+  return 0;
+#endif
+}
+
+} // cult namespace
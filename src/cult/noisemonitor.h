@@ -0,0 +1,57 @@
+#ifndef _CULT_NOISEMONITOR_H
+#define _CULT_NOISEMONITOR_H
+
+#include "globals.h"
+
+#include <vector>
+
+namespace cult {
+
+// Detects batches of samples that were disturbed (`--detect-noise`) by checking
+// involuntary context switches of the thread, interrupts handled by its CPU and
+// gaps - batches taking much longer (in TSC ticks) than the fastest batch of the
+// same test, which catches SMIs and interrupts not reported by the OS. The thread
+// must be pinned to a single CPU. Context switches and interrupts are only
+// detected on Linux.
+class NoiseMonitor {
+public:
+  enum Source : uint32_t {
+    kSourceNone          = 0x0u,
+    kSourceContextSwitch = 0x1u,
+    kSourceInterrupt     = 0x2u,
+    kSourceGap           = 0x4u
+  };
+
+  NoiseMonitor();
+  ~NoiseMonitor();
+
+  inline bool isInitialized() const { return _initialized; }
+
+  // Initializes the monitor for the calling thread and the CPU it runs on.
+  void init();
+
+  // Resets the fastest batch, must be called before the first batch of a test.
+  inline void beginTest() { _minElapsed = 0; }
+
+  void beginBatch();
+  // Returns sources of noise seen since `beginBatch()`, `kSourceNone` if none.
+  uint32_t endBatch();
+
+  uint64_t _contextSwitches();
+  uint64_t _interrupts();
+
+  bool _initialized;
+  int _interruptsFd;
+  uint32_t _cpu;
+  std::vector<char> _buffer;
+  std::vector<uint64_t> _counts;
+
+  uint64_t _startSwitches;
+  uint64_t _startInterrupts;
+  uint64_t _startTsc;
+  uint64_t _minElapsed;
+};
+
+} // cult namespace
+
+#endif // _CULT_NOISEMONITOR_H
@@ -0,0 +1,175 @@
+#include "perfcounter.h"
+#include "schedutils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace cult {
+
+#if defined(__linux__)
+// Position of the PMU type in `config` of a hardware event (extended type, Linux 5.13+).
+static constexpr uint32_t kPmuTypeShift = 32;
+
+// PMUs of hybrid CPUs, one per core type.
+static const char* const kHybridPmus[] = { "cpu_core", "cpu_atom" };
+
+// Returns the name and type of the PMU of `cpu` on hybrid CPUs or false if there
+// is a single PMU (`cpu`), which the generic hardware events are bound to. The
+// generic events of hybrid CPUs are only counted by cores of one type.
+static bool hybridPmuOf(uint32_t cpu, const char*& name, uint32_t& type) {
+  for (const char* pmu : kHybridPmus) {
+    char fileName[128];
+    snprintf(fileName, sizeof(fileName), "/sys/devices/%s/cpus", pmu);
+
+    std::vector<uint32_t> cpus;
+    if (!SchedUtils::readCpuList(fileName, cpus) || std::find(cpus.begin(), cpus.end(), cpu) == cpus.end())
+      continue;
+
+    snprintf(fileName, sizeof(fileName), "/sys/devices/%s/type", pmu);
+    FILE* file = fopen(fileName, "rb");
+    if (!file)
+      return false;
+
+    unsigned value = 0;
+    bool ok = fscanf(file, "%u", &value) == 1;
+    fclose(file);
+
+    if (!ok)
+      return false;
+
+    name = pmu;
+    type = value;
+    return true;
+  }
+
+  return false;
+}
+#endif
+
+PerfCounter::PerfCounter()
+  : _fd(-1),
+    _page(nullptr),
+    _pageSize(0),
+    _mask(~uint64_t(0)) {}
+
+PerfCounter::~PerfCounter() {
+  close();
+}
+
+#if defined(__linux__)
+bool PerfCounter::open(std::string& error) {
+  close();
+
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+
+  // The thread is pinned, so the event is opened on the PMU of its core type.
+  const char* pmu = "cpu";
+  uint32_t pmuType = 0;
+  int cpu = sched_getcpu();
+
+  if (cpu >= 0 && hybridPmuOf(uint32_t(cpu), pmu, pmuType))
+    attr.config |= uint64_t(pmuType) << kPmuTypeShift;
+  attr.pinned = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+  if (fd == -1) {
+    int err = errno;
+    error = strerror(err);
+    if (err == EACCES || err == EPERM)
+      error += " (see kernel.perf_event_paranoid)";
+    else if (err == ENOENT || err == EOPNOTSUPP)
+      error += " (no PMU, possibly a VM)";
+    return false;
+  }
+
+  size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+  void* page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED) {
+    error = strerror(errno);
+    ::close(fd);
+    return false;
+  }
+
+  _fd = fd;
+  _page = page;
+  _pageSize = pageSize;
+
+  const perf_event_mmap_page* pc = static_cast<const perf_event_mmap_page*>(_page);
+  if (!pc->cap_user_rdpmc || index() == kInvalidIndex) {
+    error = "RDPMC not permitted (see /sys/bus/event_source/devices/";
+    error += pmu;
+    error += "/rdpmc)";
+    close();
+    return false;
+  }
+
+  if (pc->pmc_width > 0 && pc->pmc_width < 64)
+    _mask = (uint64_t(1) << pc->pmc_width) - 1u;
+  return true;
+}
+
+void PerfCounter::close() {
+  if (_page)
+    munmap(_page, _pageSize);
+
+  if (_fd != -1)
+    ::close(_fd);
+
+  _fd = -1;
+  _page = nullptr;
+  _pageSize = 0;
+  _mask = ~uint64_t(0);
+}
+
+uint32_t PerfCounter::index() const {
+  if (!_page)
+    return kInvalidIndex;
+
+  // The kernel updates the page under a sequence lock.
+  const volatile perf_event_mmap_page* pc = static_cast<const volatile perf_event_mmap_page*>(_page);
+  uint32_t seq;
+  uint32_t index;
+
+  do {
+    seq = pc->lock;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    index = pc->index;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  } while (pc->lock != seq);
+
+  return index ? index - 1u : kInvalidIndex;
+}
+#else
+bool PerfCounter::open(std::string& error) {
+  error = "not supported on this platform";
+  return false;
+}
+
+void PerfCounter::close() {}
+
+uint32_t PerfCounter::index() const {
+  return kInvalidIndex;
+}
+#endif
+
+} // cult namespace
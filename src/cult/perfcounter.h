@@ -0,0 +1,45 @@
+#ifndef _CULT_PERFCOUNTER_H
+#define _CULT_PERFCOUNTER_H
+
+#include "globals.h"
+
+#include <string>
+
+namespace cult {
+
+// Core clock cycle counter of the calling thread, which is opened by Linux
+// `perf_event_open()` and read by RDPMC from user space. Unlike TSC it counts
+// core cycles, so it's not skewed by turbo and power management. Not available
+// on other platforms, in most VMs, or when `kernel.perf_event_paranoid` or
+// `/sys/bus/event_source/devices/cpu/rdpmc` forbids it. On hybrid CPUs the
+// counter is opened on the PMU of the core type the thread is pinned to.
+class PerfCounter {
+public:
+  static constexpr uint32_t kInvalidIndex = 0xFFFFFFFFu;
+
+  PerfCounter();
+  ~PerfCounter();
+
+  inline bool isOpen() const { return _fd != -1; }
+
+  // Opens the counter for the calling thread, which must be the only thread
+  // reading it. Returns false and describes the reason in `error` on failure.
+  bool open(std::string& error);
+  void close();
+
+  // Returns the RDPMC counter (ECX) of the event, which can change when the
+  // thread is rescheduled, or `kInvalidIndex` if it's not scheduled right now.
+  uint32_t index() const;
+
+  // Mask of valid bits of the counter (counters are usually 48 bits wide).
+  inline uint64_t mask() const { return _mask; }
+
+  int _fd;
+  void* _page;
+  size_t _pageSize;
+  uint64_t _mask;
+};
+
+} // cult namespace
+
+#endif // _CULT_PERFCOUNTER_H
@@ -0,0 +1,116 @@
+#include "plancache.h"
+#include "instbench.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace cult {
+
+static const char kPlanMagic[8] = { 'C', 'U', 'L', 'T', 'P', 'L', 'A', 'N' };
+
+static void initHeader(PlanCache::Header& header, uint64_t fingerprint, uint32_t count) {
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kPlanMagic, sizeof(kPlanMagic));
+  header.version = PlanCache::kVersion;
+  header.asmjitVersion = ASMJIT_LIBRARY_VERSION;
+  header.fingerprint = fingerprint;
+  header.arch = uint32_t(Arch::kHost);
+  header.count = count;
+}
+
+bool PlanCache::load(const char* fileName, uint64_t fingerprint, std::vector<InstId>& instIds, std::vector<InstSpec>& instSpecs) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file)
+    return false;
+
+  std::vector<uint8_t> data;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    long size = ftell(file);
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0) {
+      data.resize(size_t(size));
+      if (fread(data.data(), 1, data.size(), file) != data.size())
+        data.clear();
+    }
+  }
+  fclose(file);
+
+  if (data.size() < sizeof(Header))
+    return false;
+
+  Header header;
+  Header expected;
+
+  memcpy(&header, data.data(), sizeof(Header));
+  initHeader(expected, fingerprint, header.count);
+
+  if (memcmp(header.magic, expected.magic, sizeof(kPlanMagic)) != 0 ||
+      header.version != expected.version ||
+      header.asmjitVersion != expected.asmjitVersion ||
+      header.fingerprint != expected.fingerprint ||
+      header.arch != expected.arch) {
+    return false;
+  }
+
+  size_t count = header.count;
+  const uint8_t* payload = data.data() + sizeof(Header);
+  size_t payloadSize = count * (sizeof(uint32_t) + sizeof(uint64_t));
+
+  if (data.size() - sizeof(Header) != payloadSize || checksum(payload, payloadSize) != header.checksum)
+    return false;
+
+  instIds.resize(count);
+  instSpecs.resize(count);
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t instId;
+    uint64_t instSpec;
+
+    memcpy(&instId, payload + i * sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&instSpec, payload + count * sizeof(uint32_t) + i * sizeof(uint64_t), sizeof(uint64_t));
+
+    if (instId == 0 || instId >= x86::Inst::_kIdCount)
+      return false;
+
+    instIds[i] = instId;
+    instSpecs[i] = InstSpec { instSpec };
+  }
+
+  return true;
+}
+
+bool PlanCache::save(const char* fileName, uint64_t fingerprint, const std::vector<InstId>& instIds, const std::vector<InstSpec>& instSpecs) {
+  size_t count = instIds.size();
+  std::vector<uint8_t> payload(count * (sizeof(uint32_t) + sizeof(uint64_t)));
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t instId = instIds[i];
+    uint64_t instSpec = instSpecs[i].value;
+
+    memcpy(payload.data() + i * sizeof(uint32_t), &instId, sizeof(uint32_t));
+    memcpy(payload.data() + count * sizeof(uint32_t) + i * sizeof(uint64_t), &instSpec, sizeof(uint64_t));
+  }
+
+  Header header;
+  initHeader(header, fingerprint, uint32_t(count));
+  header.checksum = checksum(payload.data(), payload.size());
+
+  FILE* file = fopen(fileName, "wb");
+  if (!file)
+    return false;
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            (payload.empty() || fwrite(payload.data(), payload.size(), 1, file) == 1);
+  return fclose(file) == 0 && ok;
+}
+
+// 64-bit FNV-1a hash, detects truncated or otherwise corrupted files.
+uint64_t PlanCache::checksum(const uint8_t* data, size_t size) {
+  uint64_t hash = 0xCBF29CE484222325u;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001B3u;
+  }
+  return hash;
+}
+
+} // cult namespace
@@ -0,0 +1,44 @@
+#ifndef _CULT_PLANCACHE_H
+#define _CULT_PLANCACHE_H
+
+#include "globals.h"
+
+#include <vector>
+
+namespace cult {
+
+struct InstSpec;
+
+// Caches the result of classification - all specs of all instructions that can
+// run on the host - in a compact binary file. Classification depends only on the
+// CPU (CPUID fingerprint), the AsmJit instruction database and the target arch,
+// which are stored in the header, thus a single cache can be shared by machines
+// of the same kind.
+//
+// The file has a fixed size header followed by `count` instruction ids (32-bit)
+// and `count` specs (64-bit), everything in host byte order.
+class PlanCache {
+public:
+  enum : uint32_t { kVersion = 1 };
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t asmjitVersion;
+    uint64_t fingerprint;
+    uint32_t arch;
+    uint32_t count;
+    uint64_t checksum;
+  };
+
+  // Loads the cache, returns false if the file doesn't exist, is corrupted or
+  // doesn't match the host.
+  static bool load(const char* fileName, uint64_t fingerprint, std::vector<InstId>& instIds, std::vector<InstSpec>& instSpecs);
+  static bool save(const char* fileName, uint64_t fingerprint, const std::vector<InstId>& instIds, const std::vector<InstSpec>& instSpecs);
+
+  static uint64_t checksum(const uint8_t* data, size_t size);
+};
+
+} // cult namespace
+
+#endif // _CULT_PLANCACHE_H
@@ -0,0 +1,252 @@
+#include "profiler.h"
+#include "cpuutils.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace cult {
+
+// Number of specs printed in verbose mode.
+static constexpr size_t kPrintedSpecs = 20;
+
+// ============================================================================
+// [cult::Profiler::Scope]
+// ============================================================================
+
+Profiler::Scope::Scope(Profiler& profiler, const char* name, const char* detail, Phase phase)
+  : _profiler(profiler),
+    _name(name),
+    _detail(detail),
+    _phase(phase),
+    _startCycles(0) {
+  if (_profiler.enabled()) {
+    _start = Clock::now();
+    _startCycles = CpuUtils::rdtsc();
+  }
+}
+
+Profiler::Scope::~Scope() {
+  if (_profiler.enabled()) {
+    uint64_t cycles = CpuUtils::rdtsc() - _startCycles;
+    _profiler.addEvent(_name, _detail, _phase, _start, Clock::now(), cycles);
+  }
+}
+
+// ============================================================================
+// [cult::Profiler]
+// ============================================================================
+
+Profiler::Profiler()
+  : _enabled(false),
+    _origin(Clock::now()) {}
+
+void Profiler::enable() {
+  _enabled = true;
+  _origin = Clock::now();
+}
+
+void Profiler::addEvent(const char* name, const char* detail, Phase phase, Clock::time_point start, Clock::time_point end, uint64_t cycles) {
+  if (!_enabled)
+    return;
+
+  double startUs = std::chrono::duration<double, std::micro>(start - _origin).count();
+  double durationUs = std::chrono::duration<double, std::micro>(end - start).count();
+
+  std::lock_guard<std::mutex> guard(_mutex);
+  _events.push_back(Event { name, detail ? std::string(detail) : std::string(), _threadIndex(), startUs, durationUs, cycles });
+
+  if (!detail || phase == kPhaseNone)
+    return;
+
+  SpecProfile& spec = _specOf(detail);
+  switch (phase) {
+    case kPhaseAssemble: spec.assembleUs += durationUs; break;
+    case kPhaseAdd     : spec.addUs += durationUs; break;
+    case kPhaseMeasure : spec.measureUs += durationUs; spec.measureCycles += cycles; break;
+    default:
+      break;
+  }
+}
+
+void Profiler::addSpecResult(const char* spec, uint32_t samples, const char* stopReason) {
+  if (!_enabled)
+    return;
+
+  std::lock_guard<std::mutex> guard(_mutex);
+  SpecProfile& profile = _specOf(spec);
+  profile.samples += samples;
+  profile.stopReason = stopReason;
+}
+
+void Profiler::emit(JSONBuilder& json, bool verbose) {
+  if (!_enabled)
+    return;
+
+  std::lock_guard<std::mutex> guard(_mutex);
+
+  // Totals of phases by their name, in the order they were first seen.
+  struct PhaseTotal {
+    const char* name;
+    uint32_t count;
+    double us;
+    uint64_t cycles;
+  };
+
+  std::vector<PhaseTotal> phases;
+  for (const Event& event : _events) {
+    size_t i = 0;
+    while (i < phases.size() && strcmp(phases[i].name, event.name) != 0)
+      i++;
+
+    if (i == phases.size())
+      phases.push_back(PhaseTotal { event.name, 0, 0.0, 0 });
+
+    phases[i].count++;
+    phases[i].us += event.durationUs;
+    phases[i].cycles += event.cycles;
+  }
+
+  std::vector<size_t> order(_specs.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    const SpecProfile& sa = _specs[a];
+    const SpecProfile& sb = _specs[b];
+    return sa.assembleUs + sa.addUs + sa.measureUs > sb.assembleUs + sb.addUs + sb.measureUs;
+  });
+
+  if (verbose) {
+    printf("Self profile (wall-clock time of phases, summed over threads):\n");
+    for (const PhaseTotal& phase : phases)
+      printf("  %-20s: Count:%7u Time:%12.3f ms TSC:%16llu\n", phase.name, phase.count, phase.us / 1000.0, (unsigned long long)phase.cycles);
+
+    printf("Slowest specs:\n");
+    for (size_t i = 0; i < std::min(order.size(), kPrintedSpecs); i++) {
+      const SpecProfile& spec = _specs[order[i]];
+      printf("  %-40s: Asm:%9.3f ms Add:%9.3f ms Measure:%10.3f ms Samples:%8u Stop:%s\n",
+        spec.name.c_str(),
+        spec.assembleUs / 1000.0,
+        spec.addUs / 1000.0,
+        spec.measureUs / 1000.0,
+        spec.samples,
+        spec.stopReason);
+    }
+    printf("\n");
+  }
+
+  json.beforeRecord()
+      .addKey("profile")
+      .openObject()
+        .beforeRecord().addKey("phases")
+        .openArray();
+
+  for (const PhaseTotal& phase : phases) {
+    json.beforeRecord()
+        .openObject()
+        .addKey("name").addString(phase.name)
+        .addKey("count").addUInt(phase.count)
+        .addKey("wallUs").addDoublef("%.1f", phase.us)
+        .addKey("tsc").addUInt(phase.cycles)
+        .closeObject();
+  }
+
+  json.closeArray(true)
+      .beforeRecord().addKey("specs")
+      .openArray();
+
+  for (size_t index : order) {
+    const SpecProfile& spec = _specs[index];
+
+    json.beforeRecord()
+        .openObject()
+        .addKey("inst").addString(spec.name.c_str()).alignTo(58)
+        .addKey("assembleUs").addDoublef("%10.1f", spec.assembleUs)
+        .addKey("addUs").addDoublef("%8.1f", spec.addUs)
+        .addKey("measureUs").addDoublef("%12.1f", spec.measureUs)
+        .addKey("measureTsc").addUInt(spec.measureCycles)
+        .addKey("samples").addUInt(spec.samples)
+        .addKey("stop").addString(spec.stopReason)
+        .closeObject();
+  }
+
+  json.closeArray(true)
+      .closeObject(true);
+}
+
+// Writes all events in Chrome trace event format (complete events).
+bool Profiler::writeTrace(const char* fileName) {
+  if (!_enabled)
+    return true;
+
+  String out;
+  JSONBuilder json(&out);
+
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+
+    json.openObject()
+        .beforeRecord().addKey("displayTimeUnit").addString("ms")
+        .beforeRecord().addKey("traceEvents")
+        .openArray();
+
+    for (const Event& event : _events) {
+      json.beforeRecord()
+          .openObject()
+          .addKey("name").addString(event.name)
+          .addKey("cat").addString("cult")
+          .addKey("ph").addString("X")
+          .addKey("pid").addUInt(1)
+          .addKey("tid").addUInt(event.thread)
+          .addKey("ts").addDoublef("%.3f", event.startUs)
+          .addKey("dur").addDoublef("%.3f", event.durationUs)
+          .addKey("args")
+          .openObject()
+            .addKey("tsc").addUInt(event.cycles);
+
+      if (!event.detail.empty())
+        json.addKey("spec").addString(event.detail.c_str());
+
+      json.closeObject()
+          .closeObject();
+    }
+
+    json.closeArray(true)
+        .nl()
+        .closeObject()
+        .nl();
+  }
+
+  FILE* file = fopen(fileName, "wb");
+  if (!file)
+    return false;
+
+  fwrite(out.data(), out.size(), 1, file);
+  return fclose(file) == 0;
+}
+
+Profiler::SpecProfile& Profiler::_specOf(const char* spec) {
+  auto it = _specMap.find(spec);
+  if (it != _specMap.end())
+    return _specs[it->second];
+
+  _specMap[spec] = _specs.size();
+  _specs.push_back(SpecProfile { std::string(spec), 0.0, 0.0, 0.0, 0, 0, "none" });
+  return _specs.back();
+}
+
+uint32_t Profiler::_threadIndex() {
+  std::thread::id id = std::this_thread::get_id();
+
+  auto it = _threads.find(id);
+  if (it != _threads.end())
+    return it->second;
+
+  uint32_t index = uint32_t(_threads.size());
+  _threads[id] = index;
+  return index;
+}
+
+} // cult namespace
@@ -0,0 +1,92 @@
+#ifndef _CULT_PROFILER_H
+#define _CULT_PROFILER_H
+
+#include "globals.h"
+#include "jsonbuilder.h"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace cult {
+
+// Profiles cult itself (`--profile-self`). Records wall-clock and TSC time of
+// phases (events), aggregates them per spec and writes them as a Chrome trace
+// (chrome://tracing or https://ui.perfetto.dev). Thread safe, all methods do
+// nothing unless the profiler is enabled.
+class Profiler {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum Phase : uint32_t {
+    kPhaseNone = 0,
+    kPhaseAssemble,
+    kPhaseAdd,
+    kPhaseMeasure
+  };
+
+  struct Event {
+    const char* name;
+    std::string detail;
+    uint32_t thread;
+    double startUs;
+    double durationUs;
+    uint64_t cycles;
+  };
+
+  struct SpecProfile {
+    std::string name;
+    double assembleUs;
+    double addUs;
+    double measureUs;
+    uint64_t measureCycles;
+    uint32_t samples;
+    const char* stopReason;
+  };
+
+  // Records a phase lasting from construction to destruction of the scope. If
+  // `detail` (a spec) is given the phase is also added to that spec's profile.
+  class Scope {
+  public:
+    Scope(Profiler& profiler, const char* name, const char* detail = nullptr, Phase phase = kPhaseNone);
+    ~Scope();
+
+    Profiler& _profiler;
+    const char* _name;
+    const char* _detail;
+    Phase _phase;
+    Clock::time_point _start;
+    uint64_t _startCycles;
+  };
+
+  Profiler();
+
+  inline bool enabled() const { return _enabled; }
+  void enable();
+
+  void addEvent(const char* name, const char* detail, Phase phase, Clock::time_point start, Clock::time_point end, uint64_t cycles);
+  void addSpecResult(const char* spec, uint32_t samples, const char* stopReason);
+
+  // Adds a "profile" object to `json` and prints the slowest specs if `verbose`.
+  void emit(JSONBuilder& json, bool verbose);
+  bool writeTrace(const char* fileName);
+
+  SpecProfile& _specOf(const char* spec);
+  uint32_t _threadIndex();
+
+  bool _enabled;
+  Clock::time_point _origin;
+
+  std::mutex _mutex;
+  std::vector<Event> _events;
+  std::vector<SpecProfile> _specs;
+  std::unordered_map<std::string, size_t> _specMap;
+  std::unordered_map<std::thread::id, uint32_t> _threads;
+};
+
+} // cult namespace
+
+#endif // _CULT_PROFILER_H
@@ -0,0 +1,262 @@
+#include "resultsink.h"
+#include "instbench.h"
+
+#include <ctype.h>
+#include <string.h>
+
+namespace cult {
+
+// ============================================================================
+// [cult::ResultSink]
+// ============================================================================
+
+ResultSink::ResultSink()
+  : _file(nullptr) {}
+
+ResultSink::~ResultSink() {
+  close();
+}
+
+ResultSink* ResultSink::create(Format format) {
+  switch (format) {
+    case kFormatCSV   : return new CsvSink();
+    case kFormatBinary: return new BinarySink();
+    case kFormatXML   : return new XmlSink();
+    default:
+      return nullptr;
+  }
+}
+
+bool ResultSink::open(const char* fileName) {
+  _file = fopen(fileName, "wb");
+  if (!_file)
+    return false;
+
+  _fileName = fileName;
+  _begin();
+  return true;
+}
+
+bool ResultSink::close() {
+  if (!_file)
+    return true;
+
+  _end();
+
+  bool ok = ferror(_file) == 0;
+  ok &= fclose(_file) == 0;
+  _file = nullptr;
+  return ok;
+}
+
+// ============================================================================
+// [cult::CsvSink]
+// ============================================================================
+
+void CsvSink::_begin() {
+  fputs("inst,lat,rcp,samples,nIter,confidence\n", _file);
+}
+
+void CsvSink::addCpuInfo(const SinkCpuInfo& info) {
+  (void)info;
+}
+
+void CsvSink::addResult(const InstResult& result, const char* name) {
+  // Spec names contain commas, so they are always quoted.
+  fputc('\"', _file);
+  for (const char* p = name; *p; p++) {
+    if (*p == '\"')
+      fputc('\"', _file);
+    fputc(*p, _file);
+  }
+  fputc('\"', _file);
+
+  fprintf(_file, ",%.2f,%.2f,%u,%u,%.4f\n",
+    result.lat,
+    result.rcp,
+    unsigned(result.samples),
+    unsigned(result.nIter),
+    result.confidence);
+}
+
+// ============================================================================
+// [cult::BinarySink]
+// ============================================================================
+
+BinarySink::BinarySink() {
+  memset(&_header, 0, sizeof(_header));
+  memcpy(_header.magic, "CULTBIN", 8);
+  _header.version = kVersion;
+
+  // Offset zero is an empty string.
+  _strings.push_back('\0');
+}
+
+void BinarySink::addCpuInfo(const SinkCpuInfo& info) {
+  _header.familyId = info.familyId;
+  _header.modelId = info.modelId;
+  _header.steppingId = info.steppingId;
+  _header.fingerprint = info.fingerprint;
+  _header.vendorName = _addString(info.vendorName);
+  _header.brandString = _addString(info.brandString);
+  _header.uarchName = _addString(info.uarchName);
+}
+
+void BinarySink::addResult(const InstResult& result, const char* name) {
+  _specs.push_back(result.instSpec.value);
+  _names.push_back(_addString(name));
+  _instIds.push_back(result.instId);
+  _lat.push_back(float(result.lat));
+  _rcp.push_back(float(result.rcp));
+  _samples.push_back(result.samples);
+  _nIter.push_back(result.nIter);
+  _confidence.push_back(float(result.confidence));
+}
+
+// Columns can only be written once all results are known.
+void BinarySink::_end() {
+  _header.count = uint32_t(_specs.size());
+  _header.stringTableSize = uint32_t(_strings.size());
+
+  fwrite(&_header, sizeof(_header), 1, _file);
+
+  size_t count = _specs.size();
+  if (count) {
+    fwrite(_specs.data(), sizeof(uint64_t), count, _file);
+    fwrite(_names.data(), sizeof(uint32_t), count, _file);
+    fwrite(_instIds.data(), sizeof(uint32_t), count, _file);
+    fwrite(_lat.data(), sizeof(float), count, _file);
+    fwrite(_rcp.data(), sizeof(float), count, _file);
+    fwrite(_samples.data(), sizeof(uint32_t), count, _file);
+    fwrite(_nIter.data(), sizeof(uint32_t), count, _file);
+    fwrite(_confidence.data(), sizeof(float), count, _file);
+  }
+
+  fwrite(_strings.data(), 1, _strings.size(), _file);
+}
+
+uint32_t BinarySink::_addString(const char* str) {
+  if (!str || !*str)
+    return 0;
+
+  uint32_t offset = uint32_t(_strings.size());
+  _strings.append(str);
+  _strings.push_back('\0');
+  return offset;
+}
+
+// ============================================================================
+// [cult::XmlSink]
+// ============================================================================
+
+static std::string xmlEscape(const char* s) {
+  std::string out;
+  for (; *s; s++) {
+    switch (*s) {
+      case '&' : out.append("&amp;"); break;
+      case '<' : out.append("&lt;"); break;
+      case '>' : out.append("&gt;"); break;
+      case '\"': out.append("&quot;"); break;
+      case '\'': out.append("&apos;"); break;
+      default:
+        out.push_back(*s);
+        break;
+    }
+  }
+  return out;
+}
+
+static std::string toUpper(const std::string& s) {
+  std::string out(s);
+  for (char& c : out)
+    c = char(toupper((unsigned char)c));
+  return out;
+}
+
+// Returns the uops.info operand type and width of an `InstSpec` operand.
+static const char* xmlOperandType(uint32_t op, uint32_t& width) {
+  switch (op) {
+    case InstSpec::kOpGpb : width = 8  ; return "reg";
+    case InstSpec::kOpGpw : width = 16 ; return "reg";
+    case InstSpec::kOpGpd : width = 32 ; return "reg";
+    case InstSpec::kOpGpq : width = 64 ; return "reg";
+    case InstSpec::kOpMm  : width = 64 ; return "reg";
+    case InstSpec::kOpXmm :
+    case InstSpec::kOpXmm0: width = 128; return "reg";
+    case InstSpec::kOpYmm : width = 256; return "reg";
+    case InstSpec::kOpZmm : width = 512; return "reg";
+    case InstSpec::kOpKReg: width = 64 ; return "reg";
+    case InstSpec::kOpImm8 : width = 8 ; return "imm";
+    case InstSpec::kOpImm16: width = 16; return "imm";
+    case InstSpec::kOpImm32: width = 32; return "imm";
+    case InstSpec::kOpImm64: width = 64; return "imm";
+    case InstSpec::kOpMem8  : width = 8  ; return "mem";
+    case InstSpec::kOpMem16 : width = 16 ; return "mem";
+    case InstSpec::kOpMem32 : width = 32 ; return "mem";
+    case InstSpec::kOpMem64 : width = 64 ; return "mem";
+    case InstSpec::kOpMem128: width = 128; return "mem";
+    case InstSpec::kOpMem256: width = 256; return "mem";
+    case InstSpec::kOpMem512: width = 512; return "mem";
+    case InstSpec::kOpRel   : width = 32 ; return "label";
+    default:
+      break;
+  }
+
+  if (op >= InstSpec::kOpAl && op <= InstSpec::kOpBl) { width = 8; return "reg"; }
+  if (op >= InstSpec::kOpAx && op <= InstSpec::kOpBx) { width = 16; return "reg"; }
+  if (op >= InstSpec::kOpEax && op <= InstSpec::kOpEbx) { width = 32; return "reg"; }
+  if (op >= InstSpec::kOpRax && op <= InstSpec::kOpRbx) { width = 64; return "reg"; }
+
+  width = 0;
+  return "unknown";
+}
+
+void XmlSink::_begin() {
+  fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n", _file);
+  fputs("<root>\n", _file);
+}
+
+void XmlSink::_end() {
+  fputs("</root>\n", _file);
+}
+
+void XmlSink::addCpuInfo(const SinkCpuInfo& info) {
+  _arch = info.uarchName && *info.uarchName ? info.uarchName : "unknown";
+
+  fprintf(_file, "  <cpu vendor=\"%s\" brand=\"%s\" uarch=\"%s\" family=\"0x%02X\" model=\"0x%02X\" stepping=\"0x%02X\" fingerprint=\"0x%016llX\"/>\n",
+    xmlEscape(info.vendorName).c_str(),
+    xmlEscape(info.brandString).c_str(),
+    xmlEscape(_arch.c_str()).c_str(),
+    info.familyId,
+    info.modelId,
+    info.steppingId,
+    (unsigned long long)info.fingerprint);
+}
+
+void XmlSink::addResult(const InstResult& result, const char* name) {
+  // uops.info describes forms like "ADD (R32, R32)".
+  std::string inst(name);
+  std::string mnemonic = inst.substr(0, inst.find(' '));
+  std::string operands = mnemonic.size() < inst.size() ? inst.substr(mnemonic.size() + 1) : std::string();
+  std::string form = toUpper(mnemonic) + " (" + toUpper(operands) + ")";
+
+  fprintf(_file, "  <instruction asm=\"%s\" string=\"%s\">\n",
+    xmlEscape(toUpper(mnemonic).c_str()).c_str(),
+    xmlEscape(form.c_str()).c_str());
+
+  for (uint32_t i = 0; i < result.instSpec.count(); i++) {
+    uint32_t width;
+    const char* type = xmlOperandType(result.instSpec.get(i), width);
+    fprintf(_file, "    <operand idx=\"%u\" type=\"%s\" width=\"%u\"/>\n", i + 1, type, width);
+  }
+
+  fprintf(_file, "    <architecture name=\"%s\">\n", xmlEscape(_arch.c_str()).c_str());
+  fprintf(_file, "      <measurement TP=\"%.2f\" samples=\"%u\" confidence=\"%.4f\">\n",
+    result.rcp, unsigned(result.samples), result.confidence);
+  fprintf(_file, "        <latency cycles=\"%.2f\"/>\n", result.lat);
+  fputs("      </measurement>\n", _file);
+  fputs("    </architecture>\n", _file);
+  fputs("  </instruction>\n", _file);
+}
+
+} // cult namespace
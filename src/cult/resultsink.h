@@ -0,0 +1,145 @@
+#ifndef _CULT_RESULTSINK_H
+#define _CULT_RESULTSINK_H
+
+#include "globals.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace cult {
+
+struct InstResult;
+
+// ============================================================================
+// [cult::SinkCpuInfo]
+// ============================================================================
+
+// CPU identification passed to result sinks by `CpuDetect`.
+struct SinkCpuInfo {
+  const char* vendorName;
+  const char* brandString;
+  const char* uarchName;
+  uint32_t familyId;
+  uint32_t modelId;
+  uint32_t steppingId;
+  uint64_t fingerprint;
+};
+
+// ============================================================================
+// [cult::ResultSink]
+// ============================================================================
+
+// Receives CPU information and final results in addition to the JSON output,
+// in a format that is cheaper to ingest (see `--csv`, `--bin` and `--xml`).
+class ResultSink {
+public:
+  enum Format : uint32_t {
+    kFormatCSV = 0,
+    kFormatBinary,
+    kFormatXML
+  };
+
+  ResultSink();
+  virtual ~ResultSink();
+
+  static ResultSink* create(Format format);
+
+  bool open(const char* fileName);
+  bool close();
+
+  virtual void addCpuInfo(const SinkCpuInfo& info) = 0;
+  // Adds a final result, `name` is the spec formatted by `InstBench::formatSpec()`.
+  virtual void addResult(const InstResult& result, const char* name) = 0;
+
+  virtual void _begin() {}
+  virtual void _end() {}
+
+  FILE* _file;
+  std::string _fileName;
+};
+
+// ============================================================================
+// [cult::CsvSink]
+// ============================================================================
+
+// One line per result having columns `inst,lat,rcp,samples,nIter,confidence`,
+// CPU information is not part of the table.
+class CsvSink : public ResultSink {
+public:
+  void addCpuInfo(const SinkCpuInfo& info) override;
+  void addResult(const InstResult& result, const char* name) override;
+
+  void _begin() override;
+};
+
+// ============================================================================
+// [cult::BinarySink]
+// ============================================================================
+
+// Columnar binary format, all values in little endian byte order:
+//
+//   Header    - `BinarySink::Header`.
+//   Columns   - `count` values of each column: spec (uint64), name (uint32 offset
+//               to the string table), instId (uint32), lat (float), rcp (float),
+//               samples (uint32), nIter (uint32) and confidence (float).
+//   Strings   - `stringTableSize` bytes of null terminated strings.
+class BinarySink : public ResultSink {
+public:
+  enum : uint32_t { kVersion = 1 };
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t stringTableSize;
+    uint32_t familyId;
+    uint32_t modelId;
+    uint32_t steppingId;
+    uint64_t fingerprint;
+    uint32_t vendorName;
+    uint32_t brandString;
+    uint32_t uarchName;
+    uint32_t reserved;
+  };
+
+  BinarySink();
+
+  void addCpuInfo(const SinkCpuInfo& info) override;
+  void addResult(const InstResult& result, const char* name) override;
+
+  void _end() override;
+  uint32_t _addString(const char* str);
+
+  Header _header;
+  std::vector<uint64_t> _specs;
+  std::vector<uint32_t> _names;
+  std::vector<uint32_t> _instIds;
+  std::vector<float> _lat;
+  std::vector<float> _rcp;
+  std::vector<uint32_t> _samples;
+  std::vector<uint32_t> _nIter;
+  std::vector<float> _confidence;
+  std::string _strings;
+};
+
+// ============================================================================
+// [cult::XmlSink]
+// ============================================================================
+
+// XML having a layout of uops.info instruction tables - an `instruction` element
+// per result with `operand` elements and a `measurement` of the host `architecture`.
+class XmlSink : public ResultSink {
+public:
+  void addCpuInfo(const SinkCpuInfo& info) override;
+  void addResult(const InstResult& result, const char* name) override;
+
+  void _begin() override;
+  void _end() override;
+
+  std::string _arch;
+};
+
+} // cult namespace
+
+#endif // _CULT_RESULTSINK_H
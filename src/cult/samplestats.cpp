@@ -0,0 +1,98 @@
+#include "samplestats.h"
+
+#include <math.h>
+
+namespace cult {
+
+SampleHistogram::SampleHistogram()
+  : _count(0),
+    _min(0),
+    _max(0),
+    _mean(0.0),
+    _m2(0.0) {}
+
+void SampleHistogram::reset() {
+  _buckets.assign(kBucketCount, 0);
+  _count = 0;
+  _min = 0;
+  _max = 0;
+  _mean = 0.0;
+  _m2 = 0.0;
+}
+
+void SampleHistogram::add(uint64_t value) {
+  if (_buckets.empty())
+    _buckets.assign(kBucketCount, 0);
+
+  _buckets[bucketOf(value)]++;
+
+  _min = _count ? std::min(_min, value) : value;
+  _max = _count ? std::max(_max, value) : value;
+  _count++;
+
+  double delta = double(value) - _mean;
+  _mean += delta / double(_count);
+  _m2 += delta * (double(value) - _mean);
+}
+
+double SampleHistogram::quantile(double q) const {
+  if (!_count)
+    return 0.0;
+
+  uint64_t rank = uint64_t(ceil(q * double(_count)));
+  rank = std::min<uint64_t>(std::max<uint64_t>(rank, 1), _count);
+
+  uint64_t seen = 0;
+  for (uint32_t bucket = 0; bucket < kBucketCount; bucket++) {
+    seen += _buckets[bucket];
+    if (seen >= rank) {
+      double value = double(bucketStart(bucket)) + double(bucketWidth(bucket) - 1) * 0.5;
+      return std::min(std::max(value, double(_min)), double(_max));
+    }
+  }
+
+  return double(_max);
+}
+
+void SampleHistogram::stats(SampleStats& out, double scale, double offset) const {
+  out.count = _count;
+  if (!_count) {
+    out.min = out.median = out.p90 = out.p99 = out.stddev = 0.0;
+    return;
+  }
+
+  out.min = double(_min) * scale + offset;
+  out.median = quantile(0.5) * scale + offset;
+  out.p90 = quantile(0.9) * scale + offset;
+  out.p99 = quantile(0.99) * scale + offset;
+  out.stddev = _count > 1 ? sqrt(_m2 / double(_count - 1)) * fabs(scale) : 0.0;
+}
+
+// Values below `kSubBuckets` have their own bucket, larger values are grouped by
+// their most significant bit and split by the `kSubBits` bits that follow it.
+uint32_t SampleHistogram::bucketOf(uint64_t value) {
+  if (value < kSubBuckets)
+    return uint32_t(value);
+
+  uint32_t msb = 63 - Support::clz(value);
+  uint32_t shift = msb - kSubBits;
+  uint32_t sub = uint32_t(value >> shift) & (kSubBuckets - 1);
+  return (shift + 1) * kSubBuckets + sub;
+}
+
+uint64_t SampleHistogram::bucketStart(uint32_t bucket) {
+  if (bucket < kSubBuckets)
+    return bucket;
+
+  uint32_t shift = bucket / kSubBuckets - 1;
+  uint32_t sub = bucket % kSubBuckets;
+  return uint64_t(kSubBuckets + sub) << shift;
+}
+
+uint64_t SampleHistogram::bucketWidth(uint32_t bucket) {
+  if (bucket < kSubBuckets)
+    return 1;
+  return uint64_t(1) << (bucket / kSubBuckets - 1);
+}
+
+} // cult namespace
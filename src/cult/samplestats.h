@@ -0,0 +1,68 @@
+#ifndef _CULT_SAMPLESTATS_H
+#define _CULT_SAMPLESTATS_H
+
+#include "globals.h"
+
+#include <vector>
+
+namespace cult {
+
+// ============================================================================
+// [cult::SampleStats]
+// ============================================================================
+
+// Distribution of samples of a single test (see `--stats`).
+struct SampleStats {
+  uint64_t count;
+  double min;
+  double median;
+  double p90;
+  double p99;
+  double stddev;
+};
+
+// ============================================================================
+// [cult::SampleHistogram]
+// ============================================================================
+
+// Log-linear histogram of samples (cycles) - each power of two is split into
+// `kSubBuckets` linear buckets, so quantiles have a relative error below
+// 1 / kSubBuckets while the memory used doesn't depend on the number of samples.
+// The mean and the standard deviation are computed exactly.
+class SampleHistogram {
+public:
+  static constexpr uint32_t kSubBits = 7;
+  static constexpr uint32_t kSubBuckets = 1u << kSubBits;
+  static constexpr uint32_t kBucketCount = (64 - kSubBits + 1) * kSubBuckets;
+
+  SampleHistogram();
+
+  void reset();
+  void add(uint64_t value);
+
+  inline uint64_t count() const { return _count; }
+
+  // Returns the value at quantile `q` (0 to 1), which is the middle of its bucket.
+  double quantile(double q) const;
+
+  // Computes statistics of samples mapped by `value * scale + offset`, which is
+  // how the result is computed from the best sample.
+  void stats(SampleStats& out, double scale, double offset) const;
+
+  static uint32_t bucketOf(uint64_t value);
+  static uint64_t bucketStart(uint32_t bucket);
+  static uint64_t bucketWidth(uint32_t bucket);
+
+  std::vector<uint32_t> _buckets;
+  uint64_t _count;
+  uint64_t _min;
+  uint64_t _max;
+
+  // Welford's running mean and sum of squared differences.
+  double _mean;
+  double _m2;
+};
+
+} // cult namespace
+
+#endif // _CULT_SAMPLESTATS_H
@@ -1,15 +1,86 @@
 #include "schedutils.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+
 #if defined(__APPLE__)
 #include <mach/thread_act.h>
 #include <mach/thread_policy.h>
+#include <sys/sysctl.h>
+#endif
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+#include <sched.h>
+#include <sys/mman.h>
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
 namespace cult {
 
 #if defined(_WIN32)
 void SchedUtils::setAffinity(uint32_t cpu) {
-  SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)(1 << cpu));
+  SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+}
+
+void SchedUtils::allowedCpus(std::vector<uint32_t>& out) {
+  out.clear();
+
+  DWORD_PTR processMask = 0;
+  DWORD_PTR systemMask = 0;
+  if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+    for (uint32_t cpu = 0; cpu < sizeof(DWORD_PTR) * 8; cpu++)
+      if (processMask & (DWORD_PTR(1) << cpu))
+        out.push_back(cpu);
+  }
+
+  if (out.empty())
+    out.push_back(0);
+}
+
+void SchedUtils::physicalCores(const std::vector<uint32_t>& allowed, std::vector<uint32_t>& out) {
+  out.clear();
+
+  DWORD size = 0;
+  GetLogicalProcessorInformation(nullptr, &size);
+
+  std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+  if (!info.empty() && GetLogicalProcessorInformation(info.data(), &size)) {
+    for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& item : info) {
+      if (item.Relationship == RelationProcessorCore && item.ProcessorMask != 0) {
+        uint32_t cpu = Support::ctz(uint64_t(item.ProcessorMask));
+        if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+          out.push_back(cpu);
+      }
+    }
+  }
+
+  if (out.empty())
+    out.push_back(allowed.empty() ? 0u : allowed[0]);
+  std::sort(out.begin(), out.end());
+}
+
+bool SchedUtils::setRealtime(std::string& error) {
+  if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+    error = "SetThreadPriority() failed";
+    return false;
+  }
+  return true;
+}
+
+bool SchedUtils::lockMemory(std::string& error) {
+  error = "not supported on this platform";
+  return false;
 }
 #elif defined(__APPLE__)
 void SchedUtils::setAffinity(uint32_t cpu) {
@@ -19,6 +90,42 @@ void SchedUtils::setAffinity(uint32_t cpu) {
 
   thread_policy_set(mach_thread, THREAD_AFFINITY_POLICY, (thread_policy_t)&policy, 1);
 }
+
+void SchedUtils::allowedCpus(std::vector<uint32_t>& out) {
+  int count = 0;
+  size_t size = sizeof(count);
+
+  if (sysctlbyname("hw.logicalcpu", &count, &size, nullptr, 0) != 0 || count <= 0)
+    count = 1;
+
+  out.clear();
+  for (int i = 0; i < count; i++)
+    out.push_back(uint32_t(i));
+}
+
+void SchedUtils::physicalCores(const std::vector<uint32_t>& allowed, std::vector<uint32_t>& out) {
+  // macOS doesn't expose SMT siblings and affinity is only a hint (a tag that
+  // groups threads), so we just use one tag per physical core.
+  int count = 0;
+  size_t size = sizeof(count);
+
+  if (sysctlbyname("hw.physicalcpu", &count, &size, nullptr, 0) != 0 || count <= 0)
+    count = 1;
+
+  out.clear();
+  for (int i = 0; i < count; i++)
+    out.push_back(uint32_t(i));
+}
+
+bool SchedUtils::setRealtime(std::string& error) {
+  error = "not supported on this platform";
+  return false;
+}
+
+bool SchedUtils::lockMemory(std::string& error) {
+  error = "not supported on this platform";
+  return false;
+}
 #else
 void SchedUtils::setAffinity(uint32_t cpu) {
   pthread_t thread = pthread_self();
@@ -29,6 +136,243 @@ void SchedUtils::setAffinity(uint32_t cpu) {
 
   pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
 }
+
+// Returns the lowest CPU id in a sysfs CPU list like "0,16" or "0-1".
+static bool readFirstSibling(uint32_t cpu, uint32_t* out) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  unsigned int first = 0;
+  bool ok = fscanf(file, "%u", &first) == 1;
+  fclose(file);
+
+  if (ok)
+    *out = uint32_t(first);
+  return ok;
+}
+
+void SchedUtils::allowedCpus(std::vector<uint32_t>& out) {
+  out.clear();
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+        out.push_back(cpu);
+  }
+
+  if (out.empty())
+    out.push_back(0);
+}
+
+void SchedUtils::physicalCores(const std::vector<uint32_t>& allowed, std::vector<uint32_t>& out) {
+  out.clear();
+
+  for (uint32_t cpu : allowed) {
+    // Skip SMT siblings - only the lowest allowed sibling represents the core.
+    uint32_t first;
+    if (readFirstSibling(cpu, &first) && first != cpu && std::find(allowed.begin(), allowed.end(), first) != allowed.end())
+      continue;
+
+    out.push_back(cpu);
+  }
+
+  if (out.empty())
+    out.push_back(allowed.empty() ? 0u : allowed[0]);
+}
+
+// The lowest real-time priority is enough to preempt all normal threads while
+// it doesn't compete with real-time threads of the kernel. Threads created
+// later inherit the policy.
+bool SchedUtils::setRealtime(std::string& error) {
+  sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+
+  if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+    error = strerror(errno);
+    if (errno == EPERM)
+      error += " (requires CAP_SYS_NICE or RLIMIT_RTPRIO)";
+    return false;
+  }
+  return true;
+}
+
+bool SchedUtils::lockMemory(std::string& error) {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    error = strerror(errno);
+    if (errno == EPERM || errno == ENOMEM)
+      error += " (requires CAP_IPC_LOCK or a larger RLIMIT_MEMLOCK)";
+    return false;
+  }
+  return true;
+}
 #endif
 
+void SchedUtils::prefaultStack(size_t size) {
+  volatile char* buffer = static_cast<volatile char*>(alloca(size));
+  for (size_t i = 0; i < size; i += 4096)
+    buffer[i] = 0;
+  buffer[size - 1] = 0;
+}
+
+// The first line of /proc/interrupts has a column per online CPU ("CPU0 CPU1"),
+// the following lines have a label followed by a count per column (some only
+// have a single count).
+bool SchedUtils::parseInterrupts(char* text, std::vector<uint64_t>& out) {
+  out.clear();
+
+  char* lineEnd = strchr(text, '\n');
+  if (!lineEnd)
+    return false;
+
+  // Not using strtok() as this is called by multiple measuring threads.
+  std::vector<uint32_t> columns;
+  *lineEnd = '\0';
+
+  for (char* token = strstr(text, "CPU"); token; token = strstr(token, "CPU")) {
+    char* end = nullptr;
+    unsigned long cpu = strtoul(token + 3, &end, 10);
+    if (end == token + 3)
+      return false;
+
+    columns.push_back(uint32_t(cpu));
+    token = end;
+  }
+
+  if (columns.empty())
+    return false;
+
+  out.resize(*std::max_element(columns.begin(), columns.end()) + 1, 0);
+  char* p = lineEnd + 1;
+
+  while (*p) {
+    lineEnd = strchr(p, '\n');
+    if (lineEnd)
+      *lineEnd = '\0';
+
+    char* colon = strchr(p, ':');
+    if (colon) {
+      char* s = colon + 1;
+      for (uint32_t cpu : columns) {
+        char* end = nullptr;
+        unsigned long long count = strtoull(s, &end, 10);
+        if (end == s)
+          break;
+
+        out[cpu] += count;
+        s = end;
+      }
+    }
+
+    if (!lineEnd)
+      break;
+    p = lineEnd + 1;
+  }
+
+  return true;
+}
+
+bool SchedUtils::readInterrupts(std::vector<uint64_t>& out) {
+  FILE* file = fopen("/proc/interrupts", "rb");
+  if (!file)
+    return false;
+
+  std::vector<char> text;
+  char buffer[4096];
+
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    text.insert(text.end(), buffer, buffer + n);
+
+  fclose(file);
+  text.push_back('\0');
+
+  return parseInterrupts(text.data(), out);
+}
+
+// Samples interrupts of all CPUs twice and picks the CPU that handled the least
+// of them in between. CPUs are tried in reverse order as CPU 0 usually handles
+// the most interrupts and wins ties otherwise.
+bool SchedUtils::leastInterruptedCpu(const std::vector<uint32_t>& cpus, uint32_t windowMs, uint32_t* out) {
+  std::vector<uint64_t> before;
+  std::vector<uint64_t> after;
+
+  if (cpus.empty() || !readInterrupts(before))
+    return false;
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(windowMs));
+
+  if (!readInterrupts(after))
+    return false;
+
+  bool found = false;
+  uint64_t best = 0;
+
+  for (size_t i = cpus.size(); i != 0; i--) {
+    uint32_t cpu = cpus[i - 1];
+    if (cpu >= before.size() || cpu >= after.size())
+      continue;
+
+    uint64_t count = after[cpu] - before[cpu];
+    if (!found || count < best) {
+      found = true;
+      best = count;
+      *out = cpu;
+    }
+  }
+
+  return found;
+}
+
+bool SchedUtils::parseCpuList(const char* list, std::vector<uint32_t>& out) {
+  const char* p = list;
+
+  while (*p && *p != '\n') {
+    char* end = nullptr;
+    unsigned long first = strtoul(p, &end, 10);
+    if (end == p)
+      return false;
+
+    unsigned long last = first;
+    p = end;
+
+    if (*p == '-') {
+      p++;
+      last = strtoul(p, &end, 10);
+      if (end == p || last < first)
+        return false;
+      p = end;
+    }
+
+    for (unsigned long cpu = first; cpu <= last; cpu++)
+      out.push_back(uint32_t(cpu));
+
+    if (*p == ',')
+      p++;
+    else if (*p && *p != '\n')
+      return false;
+  }
+
+  return true;
+}
+
+bool SchedUtils::readCpuList(const char* fileName, std::vector<uint32_t>& out) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file)
+    return false;
+
+  char line[4096];
+  bool ok = fgets(line, sizeof(line), file) != nullptr;
+  fclose(file);
+
+  return ok && parseCpuList(line, out);
+}
+
 } // cult namespace
@@ -3,11 +3,45 @@
 
 #include "globals.h"
 
+#include <string>
+#include <vector>
+
 namespace cult {
 namespace SchedUtils {
 
 void setAffinity(uint32_t cpu);
 
+// Fills `out` with logical CPUs the calling thread is allowed to run on, must be
+// called before the thread is pinned to get CPUs the process can run on.
+void allowedCpus(std::vector<uint32_t>& out);
+
+// Fills `out` with one logical CPU per physical core of `allowed` CPUs (the
+// lowest numbered allowed SMT sibling of each core), sorted by id.
+void physicalCores(const std::vector<uint32_t>& allowed, std::vector<uint32_t>& out);
+
+// Switches the calling thread to a real-time scheduling policy (SCHED_FIFO).
+bool setRealtime(std::string& error);
+// Locks all current and future memory of the process (mlockall).
+bool lockMemory(std::string& error);
+// Touches `size` bytes of stack below the caller so page faults don't happen
+// while measuring.
+void prefaultStack(size_t size);
+
+// Size of the stack prefaulted by `--isolate`, covers frames of benchmark functions.
+static constexpr size_t kPrefaultStackSize = 65536;
+
+// Parses /proc/interrupts (destroys `text`) to the number of interrupts handled
+// by each CPU, indexed by CPU. Reading fails on platforms other than Linux.
+bool parseInterrupts(char* text, std::vector<uint64_t>& out);
+bool readInterrupts(std::vector<uint64_t>& out);
+bool leastInterruptedCpu(const std::vector<uint32_t>& cpus, uint32_t windowMs, uint32_t* out);
+
+// Parses a CPU list as used by Linux sysfs and the kernel command line, like
+// "0-3,8,10-11", and appends all CPUs to `out`. Returns false if malformed.
+bool parseCpuList(const char* list, std::vector<uint32_t>& out);
+// Reads a file having a CPU list (like "/sys/devices/cpu_core/cpus").
+bool readCpuList(const char* fileName, std::vector<uint32_t>& out);
+
 } // SchedUtils namespace
 } // cult namespace
 
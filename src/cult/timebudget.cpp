@@ -0,0 +1,43 @@
+#include "timebudget.h"
+
+namespace cult {
+
+TimeBudget::TimeBudget()
+  : _end(Clock::now()),
+    _jobs(1),
+    _remaining(0) {}
+
+void TimeBudget::start(double seconds, uint32_t jobs) {
+  _end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+  _jobs = std::max<uint32_t>(jobs, 1);
+}
+
+void TimeBudget::schedule(size_t count) {
+  _remaining.store(count);
+}
+
+TimeBudget::Clock::time_point TimeBudget::nextDeadline() {
+  size_t remaining = _remaining.load();
+  while (remaining && !_remaining.compare_exchange_weak(remaining, remaining - 1))
+    continue;
+
+  Clock::time_point now = Clock::now();
+  if (now >= _end)
+    return now;
+
+  // Workers measure in parallel, so each of them has the remaining time for
+  // `remaining / jobs` specs.
+  double left = std::chrono::duration<double>(_end - now).count();
+  double share = std::min(left * double(_jobs) / double(std::max<size_t>(remaining, 1)), left);
+
+  return now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(share));
+}
+
+TimeBudget::Clock::time_point TimeBudget::slice(Clock::time_point deadline, uint32_t parts) {
+  Clock::time_point now = Clock::now();
+  if (now >= deadline || parts <= 1)
+    return deadline;
+  return now + (deadline - now) / parts;
+}
+
+} // cult namespace
@@ -0,0 +1,43 @@
+#ifndef _CULT_TIMEBUDGET_H
+#define _CULT_TIMEBUDGET_H
+
+#include "globals.h"
+
+#include <atomic>
+#include <chrono>
+
+namespace cult {
+
+// Spreads a wall-clock budget (`--time-budget`) over specs that remain to be
+// measured. Each spec gets a fair share of the time that is left when it starts,
+// so specs that converge early leave more time to those that follow. Shared by
+// all worker threads.
+class TimeBudget {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  TimeBudget();
+
+  // Starts the budget of `seconds` shared by `jobs` parallel workers.
+  void start(double seconds, uint32_t jobs);
+
+  // Sets the number of specs that remain to be measured.
+  void schedule(size_t count);
+
+  // Returns true if the whole budget is spent, no more specs should be started.
+  inline bool expired() const { return Clock::now() >= _end; }
+
+  // Returns the deadline of the next spec and removes it from the remaining ones.
+  Clock::time_point nextDeadline();
+
+  // Returns the deadline of the next of `parts` tests sharing time until `deadline`.
+  static Clock::time_point slice(Clock::time_point deadline, uint32_t parts);
+
+  Clock::time_point _end;
+  uint32_t _jobs;
+  std::atomic<size_t> _remaining;
+};
+
+} // cult namespace
+
+#endif // _CULT_TIMEBUDGET_H
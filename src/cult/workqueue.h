@@ -0,0 +1,59 @@
+#ifndef _CULT_WORKQUEUE_H
+#define _CULT_WORKQUEUE_H
+
+#include "globals.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace cult {
+
+// A bounded blocking FIFO used to hand work over between threads. `push()`
+// blocks while the queue is full, `pop()` blocks while it's empty and returns
+// false after the queue was closed and drained.
+template<typename T>
+class WorkQueue {
+public:
+  explicit WorkQueue(size_t capacity)
+    : _capacity(capacity),
+      _closed(false) {}
+
+  void push(const T& item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notFull.wait(lock, [this]() { return _items.size() < _capacity; });
+
+    _items.push_back(item);
+    _notEmpty.notify_one();
+  }
+
+  bool pop(T& out) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notEmpty.wait(lock, [this]() { return !_items.empty() || _closed; });
+
+    if (_items.empty())
+      return false;
+
+    out = _items.front();
+    _items.pop_front();
+    _notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+    _notEmpty.notify_all();
+  }
+
+  size_t _capacity;
+  bool _closed;
+  std::deque<T> _items;
+  std::mutex _mutex;
+  std::condition_variable _notFull;
+  std::condition_variable _notEmpty;
+};
+
+} // cult namespace
+
+#endif // _CULT_WORKQUEUE_H